@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Benchmark for the "HP" discovery backend, with canned hp-probe output
+# (80 printers) and a stand-in for avahi-resolve-address which answers
+# after RESOLVER_DELAY seconds (default 0.2). Does not need a network.
+#
+# Usage: bench/discovery/run.sh [path/to/HP]
+#
+
+set -e
+
+dir=`cd "$(dirname "$0")" && pwd`
+backend="${1:-$dir/../../HP}"
+
+HP_PROBE="$dir/hp-probe-stub"
+HP_RESOLVER="$dir/resolver-stub"
+HP_CACHE=""
+export HP_PROBE HP_RESOLVER HP_CACHE
+
+start=`date +%s.%N`
+devices=`"$backend" 2>/dev/null | grep -c '^network '`
+end=`date +%s.%N`
+
+awk -v n="$devices" -v t0="$start" -v t1="$end" -v d="${RESOLVER_DELAY:-0.2}" \
+    'BEGIN { printf("%d printers listed in %.2f sec (sequential look-ups: at least %.2f sec)\n", n, t1 - t0, n * d) }'
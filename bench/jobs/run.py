@@ -0,0 +1,474 @@
+#!/usr/bin/env python3
+#
+# End-to-end job throughput benchmark for the HPLIP Printer Application
+#
+# Starts the Printer Application with a temporary state and spool
+# directory, creates queues with representative HPLIP drivers which send
+# to socket sinks run by this script ("cups:socket://127.0.0.1:<port>",
+# via CUPS' "socket" backend), and submits a job corpus: the shipped
+# testpage.ps plus generated multi-page PDFs, PNG images, and PWG
+# Raster. The queues work in parallel, each one gets its jobs one after
+# the other, so that the data arriving at a sink belongs to exactly one
+# job.
+#
+# Reports jobs per second, pages per minute, p50/p99 of the time from
+# submitting a job to the first byte arriving at the sink, the CPU time
+# per job (Printer Application with its filters and backends), and the
+# RSS of the whole process tree. Everything runs offline on the local
+# machine, no printer and no network are needed.
+#
+# Usage: bench/jobs/run.py [--app path/to/hplip-printer-app] [options]
+#
+# Needs Python 3 (standard library only) and an installed HPLIP
+# (hpcups, PPDs), Ghostscript, and CUPS' "socket" backend in the
+# backend directory of the Printer Application (BACKEND_DIR).
+#
+
+import argparse
+import os
+import re
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+# Drivers to benchmark if none are given: The first driver matching each
+# expression (an hpcups laser printer, an hpcups inkjet, a PostScript
+# printer)
+DRIVER_PATTERNS = [r"laserjet.*pro.*m40[0-9]", r"officejet.*pro",
+                   r"postscript|hpps|-ps\b"]
+
+
+#
+# Job corpus
+#
+
+def pdf_document(pages):
+    """Multi-page US Letter PDF with text and vector graphics."""
+    objects = [b"<< /Type /Catalog /Pages 2 0 R >>", None,
+               b"<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>"]
+    kids = []
+    for page in range(1, pages + 1):
+        lines = [b"BT /F1 24 Tf 72 720 Td (Benchmark page %d of %d) Tj ET"
+                 % (page, pages)]
+        for i in range(40):
+            lines.append(b"BT /F1 10 Tf 72 %d Td (Line %d: The quick brown"
+                         b" fox jumps over the lazy dog. 0123456789) Tj ET"
+                         % (690 - 14 * i, i + 1))
+        for i in range(10):
+            lines.append(b"%.2f %.2f %.2f rg %d %d 40 40 re f"
+                         % (i / 10.0, 1 - i / 10.0, 0.5, 72 + 46 * i, 72))
+        content = b"\n".join(lines)
+        objects.append(b"<< /Length %d >>\nstream\n%s\nendstream"
+                       % (len(content), content))
+        objects.append(b"<< /Type /Page /Parent 2 0 R /MediaBox [0 0 612 792]"
+                       b" /Resources << /Font << /F1 3 0 R >> >>"
+                       b" /Contents %d 0 R >>" % len(objects))
+        kids.append(b"%d 0 R" % len(objects))
+    objects[1] = (b"<< /Type /Pages /Kids [%s] /Count %d >>"
+                  % (b" ".join(kids), pages))
+
+    out = bytearray(b"%PDF-1.4\n")
+    offsets = []
+    for num, obj in enumerate(objects, 1):
+        offsets.append(len(out))
+        out += b"%d 0 obj\n%s\nendobj\n" % (num, obj)
+    xref = len(out)
+    out += b"xref\n0 %d\n0000000000 65535 f \n" % (len(objects) + 1)
+    for offset in offsets:
+        out += b"%010d 00000 n \n" % offset
+    out += (b"trailer\n<< /Size %d /Root 1 0 R >>\nstartxref\n%d\n%%%%EOF\n"
+            % (len(objects) + 1, xref))
+    return bytes(out)
+
+
+def png_image(width, height):
+    """RGB PNG with color gradients, like a photo it does not compress
+    much."""
+    def chunk(kind, data):
+        return (struct.pack(">I", len(data)) + kind + data +
+                struct.pack(">I", zlib.crc32(kind + data) & 0xffffffff))
+
+    rows = bytearray()
+    for y in range(height):
+        rows.append(0)
+        rows += bytes((x * 255 // width, y * 255 // height,
+                       (x * y) & 255)[c] for x in range(width)
+                      for c in range(3))
+    return (b"\x89PNG\r\n\x1a\n" +
+            chunk(b"IHDR", struct.pack(">IIBBBBB", width, height, 8, 2, 0,
+                                       0, 0)) +
+            chunk(b"IDAT", zlib.compress(bytes(rows), 6)) +
+            chunk(b"IEND", b""))
+
+
+def pwg_raster(pages, resolution=300):
+    """US Letter 8-bit grayscale PWG Raster, gray bands on each page."""
+    width, height = 17 * resolution // 2, 11 * resolution
+    out = bytearray(b"RaS2")
+    for page in range(pages):
+        header = bytearray(1796)
+        header[0:9] = b"PwgRaster"
+        struct.pack_into(">II", header, 276, resolution, resolution)
+        struct.pack_into(">II", header, 352, 612, 792)   # PageSize
+        struct.pack_into(">IIIIIIIII", header, 372,
+                         width, height, 0,               # Width, Height
+                         8, 8, width,                    # Bits, BytesPerLine
+                         0, 18, 0)                       # Chunky, sgray
+        struct.pack_into(">I", header, 420, 1)           # NumColors
+        struct.pack_into(">I", header, 452, pages)       # TotalPageCount
+        header[1732:1732 + 18] = b"na_letter_8.5x11in"
+        out += header
+
+        # Bands of 256 identical lines, each line as runs of 128 pixels
+        line = bytearray()
+        for start in range(0, width, 128):
+            line += bytes((min(128, width - start) - 1, 0))
+        for y in range(0, height, 256):
+            count = min(256, height - y)
+            gray = 255 - ((y // 256 + page) * 37) % 200
+            out.append(count - 1)
+            out += bytes(line[i] if i % 2 == 0 else gray
+                         for i in range(len(line)))
+    return bytes(out)
+
+
+def write_corpus(dirname, testpage):
+    """Write the job corpus, return a list of (file, format, pages)."""
+    corpus = []
+    if testpage and os.path.exists(testpage):
+        corpus.append((testpage, "ps", 1))
+    for pages in (1, 5, 20):
+        name = os.path.join(dirname, "doc-%dp.pdf" % pages)
+        with open(name, "wb") as fp:
+            fp.write(pdf_document(pages))
+        corpus.append((name, "pdf", pages))
+    name = os.path.join(dirname, "photo.png")
+    with open(name, "wb") as fp:
+        fp.write(png_image(1200, 1600))
+    corpus.append((name, "png", 1))
+    name = os.path.join(dirname, "raster-3p.pwg")
+    with open(name, "wb") as fp:
+        fp.write(pwg_raster(3))
+    corpus.append((name, "pwg", 3))
+    return corpus
+
+
+#
+# Socket sink, stands in for the printer
+#
+
+class Sink(threading.Thread):
+    """Accepts one connection per job, records time of the first byte,
+    end, and size."""
+
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.server.bind(("127.0.0.1", 0))
+        self.server.listen(4)
+        self.port = self.server.getsockname()[1]
+        self.jobs = []
+        self.cond = threading.Condition()
+
+    def run(self):
+        while True:
+            conn, _ = self.server.accept()
+            first, size = None, 0
+            while True:
+                data = conn.recv(65536)
+                if not data:
+                    break
+                if first is None:
+                    first = time.monotonic()
+                size += len(data)
+            conn.close()
+            with self.cond:
+                self.jobs.append((first, time.monotonic(), size))
+                self.cond.notify_all()
+
+    def wait(self, count, timeout):
+        with self.cond:
+            return self.cond.wait_for(lambda: len(self.jobs) >= count,
+                                      timeout)
+
+
+#
+# Resource usage of the Printer Application and its children
+#
+
+def process_tree(pid):
+    """PIDs of a process and all its descendants."""
+    children = {}
+    for entry in os.listdir("/proc"):
+        if entry.isdigit():
+            try:
+                with open("/proc/%s/stat" % entry) as fp:
+                    ppid = int(fp.read().rsplit(")", 1)[1].split()[1])
+                children.setdefault(ppid, []).append(int(entry))
+            except (OSError, IndexError, ValueError):
+                pass
+    tree, todo = [], [pid]
+    while todo:
+        p = todo.pop()
+        tree.append(p)
+        todo.extend(children.get(p, []))
+    return tree
+
+
+def tree_rss(pid):
+    """Sum of the RSS of a process tree, in bytes."""
+    total = 0
+    for p in process_tree(pid):
+        try:
+            with open("/proc/%d/statm" % p) as fp:
+                total += int(fp.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+        except (OSError, IndexError, ValueError):
+            pass
+    return total
+
+
+def cpu_seconds(pid):
+    """CPU time of a process and its finished children, in seconds."""
+    with open("/proc/%d/stat" % pid) as fp:
+        fields = fp.read().rsplit(")", 1)[1].split()
+    return sum(int(f) for f in fields[11:15]) / os.sysconf("SC_CLK_TCK")
+
+
+class RssSampler(threading.Thread):
+    """Samples the RSS of the process tree, keeps the peak."""
+
+    def __init__(self, pid):
+        super().__init__(daemon=True)
+        self.pid, self.peak, self.running = pid, 0, True
+
+    def run(self):
+        while self.running:
+            self.peak = max(self.peak, tree_rss(self.pid))
+            time.sleep(0.05)
+
+
+#
+# Printer Application
+#
+
+def percentile(values, p):
+    values = sorted(values)
+    if not values:
+        return float("nan")
+    return values[min(len(values) - 1, int(round(p / 100.0 *
+                                                 (len(values) - 1))))]
+
+
+def app(args, env, *params, check=True):
+    return subprocess.run([args.app] + list(params), env=env, check=check,
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def select_drivers(args, env):
+    if args.driver:
+        return args.driver
+    drivers = [line.split()[0] for line in app(args, env,
+                                                 "drivers").stdout.splitlines()
+               if line.strip()]
+    selected = []
+    for pattern in DRIVER_PATTERNS:
+        for driver in drivers:
+            if re.search(pattern, driver, re.I) and driver not in selected:
+                selected.append(driver)
+                break
+    return selected
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="End-to-end job throughput benchmark")
+    parser.add_argument("--app", default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), "..", "..",
+        "hplip-printer-app"), help="Printer Application executable")
+    parser.add_argument("--driver", action="append",
+                        help="driver for a queue (repeatable), default: "
+                        "one hpcups laser, one hpcups inkjet, one PostScript")
+    parser.add_argument("--queues", type=int, default=1,
+                        help="queues per driver, working in parallel")
+    parser.add_argument("--rounds", type=int, default=2,
+                        help="times each queue prints the whole corpus")
+    parser.add_argument("--port", type=int, default=0,
+                        help="web interface port, default: a free one")
+    parser.add_argument("--testpage", default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), "..", "..",
+        "testpage.ps"), help="test page to include in the corpus")
+    parser.add_argument("--cache", action="store_true",
+                        help="turn the render cache on (repeated jobs get "
+                        "served from it)")
+    parser.add_argument("--timeout", type=float, default=600,
+                        help="seconds to wait for a job")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the temporary directory (log, metrics)")
+    parser.add_argument("--write-corpus", metavar="DIR",
+                        help="only write the job corpus into DIR")
+    args = parser.parse_args()
+
+    if args.write_corpus:
+        os.makedirs(args.write_corpus, exist_ok=True)
+        for name, fmt, pages in write_corpus(args.write_corpus,
+                                             args.testpage):
+            print("%s: %s, %d page(s), %d bytes"
+                  % (name, fmt, pages, os.path.getsize(name)))
+        return 0
+
+    if not os.access(args.app, os.X_OK):
+        sys.exit("%s not found, run \"make\" first" % args.app)
+    if os.getuid() == 0 and (os.path.exists("/run/hplip-printer-app.sock") or
+                             os.path.exists(
+                                 "/var/run/hplip-printer-app.sock")):
+        sys.exit("A Printer Application server is running already, run the "
+                 "benchmark as normal user")
+
+    tmpdir = tempfile.mkdtemp(prefix="hplip-bench-")
+    for sub in ("state", "spool", "tmp", "corpus"):
+        os.makedirs(os.path.join(tmpdir, sub))
+    env = dict(os.environ,
+               TMPDIR=os.path.join(tmpdir, "tmp"),
+               STATE_DIR=os.path.join(tmpdir, "state"),
+               STATE_FILE=os.path.join(tmpdir, "state",
+                                       "hplip-printer-app.state"),
+               SPOOL_DIR=os.path.join(tmpdir, "spool"),
+               SNMP_COMMUNITY="", DNSSD_SERVICES="", HP_CACHE="")
+    env["RENDER_CACHE_SIZE"] = "1024" if args.cache else "0"
+    if not args.port:
+        with socket.socket() as s:
+            s.bind(("127.0.0.1", 0))
+            args.port = s.getsockname()[1]
+
+    corpus = write_corpus(os.path.join(tmpdir, "corpus"), args.testpage)
+    server = subprocess.Popen(
+        [args.app, "-o", "log-level=warn",
+         "-o", "log-file=" + os.path.join(tmpdir, "log"),
+         "-o", "server-port=%d" % args.port, "server"],
+        env=env, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        # Wait for the server to come up
+        for _ in range(100):
+            try:
+                socket.create_connection(("127.0.0.1", args.port), 1).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+        else:
+            sys.exit("Printer Application did not start, see %s/log" % tmpdir)
+
+        drivers = select_drivers(args, env)
+        if not drivers:
+            sys.exit("No drivers found, is HPLIP installed?")
+
+        queues = []
+        for driver in drivers:
+            for i in range(args.queues):
+                sink = Sink()
+                sink.start()
+                name = "bench-%d" % len(queues)
+                app(args, env, "add", "-d", name, "-m", driver,
+                    "-v", "cups:socket://127.0.0.1:%d" % sink.port)
+                queues.append((name, driver, sink))
+
+        results = []
+        lock = threading.Lock()
+
+        def print_queue(name, driver, sink):
+            count = 0
+            for _ in range(args.rounds):
+                for path, fmt, pages in corpus:
+                    submitted = time.monotonic()
+                    ret = app(args, env, "submit", "-d", name, path,
+                              check=False)
+                    count += 1
+                    ok = ret.returncode == 0 and sink.wait(count,
+                                                           args.timeout)
+                    if not ok:
+                        with lock:
+                            results.append((driver, fmt, pages, None, None,
+                                            0))
+                        return
+                    first, end, size = sink.jobs[count - 1]
+                    with lock:
+                        results.append((driver, fmt, pages,
+                                        None if first is None
+                                        else first - submitted,
+                                        end - submitted, size))
+
+        sampler = RssSampler(server.pid)
+        sampler.start()
+        cpu0 = cpu_seconds(server.pid)
+        start = time.monotonic()
+        threads = [threading.Thread(target=print_queue, args=q)
+                   for q in queues]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        wall = time.monotonic() - start
+        cpu = cpu_seconds(server.pid) - cpu0
+        sampler.running = False
+
+        # Metrics of the Printer Application, for looking into details
+        try:
+            with socket.create_connection(("127.0.0.1", args.port), 5) as s:
+                s.sendall(b"GET /metrics HTTP/1.0\r\nHost: localhost\r\n\r\n")
+                with open(os.path.join(tmpdir, "metrics.txt"), "wb") as fp:
+                    while True:
+                        data = s.recv(65536)
+                        if not data:
+                            break
+                        fp.write(data)
+        except OSError:
+            pass
+    finally:
+        server.terminate()
+        try:
+            server.wait(30)
+        except subprocess.TimeoutExpired:
+            server.kill()
+
+    done = [r for r in results if r[4] is not None]
+    ttfb = [r[3] for r in done if r[3] is not None]
+    pages = sum(r[2] for r in done)
+    print("Drivers: %s" % ", ".join(drivers))
+    print("Queues: %d, jobs: %d done, %d failed, %d pages, %.1f sec"
+          % (len(queues), len(done), len(results) - len(done), pages, wall))
+    print("Throughput: %.2f jobs/sec, %.1f pages/min"
+          % (len(done) / wall, pages * 60.0 / wall))
+    print("Time to first byte at the sink: p50 %.2f sec, p99 %.2f sec"
+          % (percentile(ttfb, 50), percentile(ttfb, 99)))
+    print("CPU per job: %.2f sec, peak RSS: %.1f MB (Printer Application "
+          "with filters and backends)"
+          % (cpu / max(len(done), 1), sampler.peak / 1048576.0))
+    print("%-40s %-4s %5s %10s %10s %12s"
+          % ("Driver", "Doc", "Jobs", "TTFB p50", "Total p50", "Bytes"))
+    for driver in drivers:
+        for fmt in sorted(set(r[1] for r in done)):
+            rows = [r for r in done if r[0] == driver and r[1] == fmt]
+            if rows:
+                print("%-40s %-4s %5d %9.2fs %9.2fs %12d"
+                      % (driver[:40], fmt, len(rows),
+                         percentile([r[3] for r in rows
+                                     if r[3] is not None], 50),
+                         percentile([r[4] for r in rows], 50),
+                         sum(r[5] for r in rows) // len(rows)))
+
+    if args.keep:
+        print("Log, metrics, and state in %s" % tmpdir)
+    else:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+    return 0 if len(done) == len(results) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
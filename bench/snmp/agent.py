@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+#
+# Stand-in for the SNMP agent of a printer, answering GetBulk requests
+# (SNMPv2c) for the Host Resources and Printer MIB values polled by the
+# HPLIP Printer Application with canned values of a color laser printer.
+#
+# Usage: bench/snmp/agent.py [PORT]   (default 16161)
+#
+# Run the Printer Application with SNMP_PORT=16161 and a printer with
+# the device URI "cups:socket://localhost" to see the supply levels.
+#
+
+import socket
+import sys
+
+PRT = (1, 3, 6, 1, 2, 1, 43, 11, 1, 1)
+COLORANT = (1, 3, 6, 1, 2, 1, 43, 12, 1, 1, 4, 1)
+HR = (1, 3, 6, 1, 2, 1, 25, 3, 5, 1)
+
+SUPPLIES = [
+    # colorant index, class, type, description, max, level
+    (1, 3, 21, "Black Cartridge HP W2030A", 100, 73),
+    (2, 3, 21, "Cyan Cartridge HP W2031A", 100, 12),
+    (3, 3, 21, "Magenta Cartridge HP W2033A", 100, 55),
+    (4, 3, 21, "Yellow Cartridge HP W2032A", 100, -3),
+    (0, 4, 4, "Toner Collection Unit", 100, 20),
+]
+COLORANTS = ["black", "cyan", "magenta", "yellow"]
+
+MIB = {}
+MIB[HR + (1, 1)] = ("int", 3)                  # hrPrinterStatus: idle
+MIB[HR + (2, 1)] = ("str", b"\x20\x00")        # lowToner
+for i, (colorant, cls, typ, desc, maxcap, level) in enumerate(SUPPLIES, 1):
+    MIB[PRT + (3, 1, i)] = ("int", colorant)
+    MIB[PRT + (4, 1, i)] = ("int", cls)
+    MIB[PRT + (5, 1, i)] = ("int", typ)
+    MIB[PRT + (6, 1, i)] = ("str", desc.encode())
+    MIB[PRT + (8, 1, i)] = ("int", maxcap)
+    MIB[PRT + (9, 1, i)] = ("int", level)
+for i, name in enumerate(COLORANTS, 1):
+    MIB[COLORANT + (i,)] = ("str", name.encode())
+OIDS = sorted(MIB)
+
+
+def length(n):
+    if n < 128:
+        return bytes([n])
+    b = n.to_bytes((n.bit_length() + 7) // 8, "big")
+    return bytes([0x80 | len(b)]) + b
+
+
+def tlv(tag, data):
+    return bytes([tag]) + length(len(data)) + data
+
+
+def integer(v):
+    n = 1
+    while not -(1 << (8 * n - 1)) <= v < (1 << (8 * n - 1)):
+        n += 1
+    return tlv(0x02, v.to_bytes(n, "big", signed=True))
+
+
+def oid(o):
+    out = bytes([o[0] * 40 + o[1]])
+    for c in o[2:]:
+        b = [c & 127]
+        c >>= 7
+        while c:
+            b.insert(0, 0x80 | (c & 127))
+            c >>= 7
+        out += bytes(b)
+    return tlv(0x06, out)
+
+
+def parse(data, pos):
+    tag = data[pos]
+    n = data[pos + 1]
+    pos += 2
+    if n & 0x80:
+        k = n & 127
+        n = int.from_bytes(data[pos:pos + k], "big")
+        pos += k
+    return tag, data[pos:pos + n], pos + n
+
+
+def children(data):
+    pos = 0
+    while pos < len(data):
+        tag, value, pos = parse(data, pos)
+        yield tag, value
+
+
+def decode_oid(data):
+    o = [data[0] // 40, data[0] % 40]
+    c = 0
+    for b in data[1:]:
+        c = (c << 7) | (b & 127)
+        if not b & 0x80:
+            o.append(c)
+            c = 0
+    return tuple(o)
+
+
+def getnext(o):
+    for candidate in OIDS:
+        if candidate > o:
+            return candidate
+    return None
+
+
+def varbind(o):
+    if o is None:
+        return tlv(0x30, oid((1, 3)) + b"\x82\x00")    # endOfMibView
+    kind, value = MIB[o]
+    return tlv(0x30, oid(o) + (integer(value) if kind == "int"
+                                else tlv(0x04, value)))
+
+
+def answer(request):
+    _, message, _ = parse(request, 0)
+    parts = list(children(message))
+    community = parts[1][1]
+    pdu_tag, pdu = parts[2]
+    if pdu_tag != 0xa5:
+        return None
+    fields = list(children(pdu))
+    request_id = int.from_bytes(fields[0][1], "big", signed=True)
+    non_repeaters = int.from_bytes(fields[1][1], "big")
+    max_repetitions = int.from_bytes(fields[2][1], "big")
+    oids = [decode_oid(list(children(vb))[0][1])
+            for _, vb in children(fields[3][1])]
+    out = b""
+    for o in oids[:non_repeaters]:
+        out += varbind(getnext(o))
+    current = oids[non_repeaters:]
+    for _ in range(max_repetitions):
+        current = [getnext(o) if o else None for o in current]
+        out += b"".join(varbind(o) for o in current)
+    pdu = integer(request_id) + integer(0) + integer(0) + tlv(0x30, out)
+    return tlv(0x30, integer(1) + tlv(0x04, community) + tlv(0xa2, pdu))
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 16161
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", port))
+    print("SNMP agent stand-in listening on 127.0.0.1:%d" % port)
+    while True:
+        request, peer = sock.recvfrom(65536)
+        try:
+            response = answer(request)
+        except (IndexError, ValueError):
+            continue
+        if response:
+            sock.sendto(response, peer)
+
+
+if __name__ == "__main__":
+    main()
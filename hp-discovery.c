@@ -0,0 +1,864 @@
+//
+// "HP" discovery-only CUPS backend for the HPLIP Printer Application
+//
+// Finds network printers with HPLIP's "hp-probe" utility and lists them
+// in the device list format of CUPS backends. In the device URIs the IP
+// address gets replaced by the printer's ZeroConf name, or, if it does
+// not have one, by its host name. The names of all printers are looked
+// up in parallel and each printer is listed as soon as its names are
+// looked up, so a large number of printers does not slow down the
+// discovery.
+//
+// hp-probe only reports when its timeout is over, therefore it is run in
+// rounds of growing length, and the discovery stops after a minimum time
+// once the rounds have not found any new printer for a quiet period.
+//
+// The found printers are cached, with the time when each was seen last.
+// While the cache is recent the printers are listed from it right away,
+// and the cache gets refreshed in the background.
+//
+// Copyright © 2020-2021 by Till Kamppeter.
+//
+// Licensed under Apache License v2.0.  See the file "LICENSE" for more
+// information.
+//
+
+//
+// Include necessary headers...
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+
+
+//
+// Constants...
+//
+
+// Commands, can be replaced via environment variables, for example by
+// stand-ins for benchmarking
+
+#define PROBE_COMMAND "hp-probe -bnet -o%d" // HP_PROBE, complete command
+					    // line, run by the shell, "%d"
+					    // is the timeout of a round
+#define RESOLVER_COMMAND "avahi-resolve-address"
+					    // HP_RESOLVER, gets the IP
+					    // address as argument
+
+// Timeouts
+
+#define RESOLVE_TIMEOUT 2                   // HP_RESOLVE_TIMEOUT, seconds
+					    // for looking up the names of a
+					    // printer
+#define PROBE_MIN 5                         // HP_PROBE_MIN, min. seconds of
+					    // all hp-probe rounds, the
+					    // window of a single hp-probe
+					    // run used before
+#define PROBE_QUIET 2                       // HP_PROBE_QUIET, seconds of
+					    // rounds without new printers
+					    // after which probing stops
+#define PROBE_TIMEOUT 30                    // HP_PROBE_TIMEOUT, max. seconds
+					    // for all hp-probe rounds
+
+// Cache of found printers
+
+#ifndef STATE_DIR
+#  define STATE_DIR "/var/lib/hplip-printer-app"
+#endif
+#define CACHE_FILE "hp-discovery.cache"     // In STATE_DIR, or HP_CACHE,
+					    // complete path, "" = no cache
+#define CACHE_REFRESH 60                    // HP_CACHE_REFRESH, seconds
+					    // after which the cache gets
+					    // refreshed in the background
+#define CACHE_TTL 600                       // HP_CACHE_TTL, seconds after
+					    // which printers not seen any
+					    // more get removed
+
+
+//
+// Types...
+//
+
+typedef struct device_s			// Discovered printer
+{
+  char		uri[1024],		// Device URI
+		model[256],		// Make and model
+		netid[256],		// Network ID (MAC address)
+		ip[64];			// IP address from the URI
+  char		line[4096];		// Line in the device list
+  int		listed;			// Already listed?
+  double	found;			// Time when hp-probe reported it
+  pthread_t	tid;			// Name look-up thread
+  struct device_s *next;		// Next printer
+} device_t;
+
+typedef struct cache_entry_s		// Printer in the cache
+{
+  time_t	seen;			// Last time found
+  char		netid[256],		// Network ID (MAC address)
+		line[4096];		// Line in the device list
+  struct cache_entry_s *next;		// Next printer
+} cache_entry_t;
+
+
+//
+// Global variables...
+//
+
+static pthread_mutex_t	devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	devices_cond = PTHREAD_COND_INITIALIZER;
+static int		num_pending = 0;
+static const char	*resolver = RESOLVER_COMMAND;
+static int		resolve_timeout = RESOLVE_TIMEOUT;
+static int		list_devices = 1;
+static double		start_time;
+
+
+//
+// 'hp_time()' - Current time in seconds (monotonic)
+//
+
+static double
+hp_time(void)
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0);
+}
+
+
+//
+// 'hp_in_path()' - Check whether a program is in the $PATH
+//
+
+static int
+hp_in_path(const char *program)
+{
+  const char *path,
+             *end;
+  char buf[1024];
+
+
+  if (strchr(program, '/'))
+    return (!access(program, X_OK));
+
+  if ((path = getenv("PATH")) == NULL)
+    path = "/usr/local/bin:/usr/bin:/bin";
+
+  while (*path)
+  {
+    if ((end = strchr(path, ':')) == NULL)
+      end = path + strlen(path);
+    snprintf(buf, sizeof(buf), "%.*s/%s", (int)(end - path), path, program);
+    if (!access(buf, X_OK))
+      return (1);
+    path = (*end ? end + 1 : end);
+  }
+
+  return (0);
+}
+
+
+//
+// 'hp_zeroconf_name()' - Look up the ZeroConf name of an IP address with
+//                        "avahi-resolve-address", giving up after the
+//                        timeout
+//
+
+static int
+hp_zeroconf_name(const char *ip,
+		 char *name,
+		 size_t namesize)
+{
+  int pipefds[2],
+      status;
+  pid_t pid;
+  struct pollfd pfd;
+  char buf[1024],
+       *ptr,
+       *end;
+  size_t len = 0;
+  ssize_t bytes;
+  double deadline;
+
+
+  if (pipe2(pipefds, O_CLOEXEC))
+    return (0);
+
+  if ((pid = fork()) == 0)
+  {
+    int nullfd;
+
+    dup2(pipefds[1], 1);
+    if ((nullfd = open("/dev/null", O_RDWR)) >= 0)
+    {
+      dup2(nullfd, 0);
+      dup2(nullfd, 2);
+    }
+    execlp(resolver, resolver, ip, (char *)NULL);
+    _exit(127);
+  }
+
+  close(pipefds[1]);
+  if (pid < 0)
+  {
+    close(pipefds[0]);
+    return (0);
+  }
+
+  deadline = hp_time() + resolve_timeout;
+  pfd.fd     = pipefds[0];
+  pfd.events = POLLIN;
+
+  while (len < sizeof(buf) - 1)
+  {
+    int timeout = (int)((deadline - hp_time()) * 1000);
+
+    if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0)
+      break;
+    if ((bytes = read(pipefds[0], buf + len, sizeof(buf) - 1 - len)) < 0 &&
+	errno == EINTR)
+      continue;
+    if (bytes <= 0)
+      break;
+    len += bytes;
+  }
+  buf[len] = '\0';
+  close(pipefds[0]);
+
+  // Timed out or finished, do not leave a zombie
+  kill(pid, SIGKILL);
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+  // Output: "<IP>\t<Name>.local"
+  ptr = buf;
+  while (*ptr && !isspace(*ptr))
+    ptr ++;
+  while (*ptr && isspace(*ptr))
+    ptr ++;
+  for (end = ptr; *end && !isspace(*end); end ++);
+  *end = '\0';
+  if (end > ptr && end[-1] == '.')
+    *(-- end) = '\0';
+  if (end - ptr > 6 && !strcasecmp(end - 6, ".local"))
+    end[-6] = '\0';
+
+  // Names which do not fit are of no use, keep the IP then
+  if (!*ptr || snprintf(name, namesize, "%s", ptr) >= (int)namesize)
+    return (0);
+
+  return (1);
+}
+
+
+//
+// 'hp_host_name()' - Look up the host name of an IP address
+//
+
+static int
+hp_host_name(const char *ip,
+	     char *name,
+	     size_t namesize)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  size_t len;
+
+
+  memset(&addr, 0, sizeof(addr));
+  if (inet_pton(AF_INET, ip, &((struct sockaddr_in *)&addr)->sin_addr) == 1)
+  {
+    addr.ss_family = AF_INET;
+    addrlen        = sizeof(struct sockaddr_in);
+  }
+  else if (inet_pton(AF_INET6, ip,
+		     &((struct sockaddr_in6 *)&addr)->sin6_addr) == 1)
+  {
+    addr.ss_family = AF_INET6;
+    addrlen        = sizeof(struct sockaddr_in6);
+  }
+  else
+    return (0);
+
+  if (getnameinfo((struct sockaddr *)&addr, addrlen, name, namesize, NULL, 0,
+		  NI_NAMEREQD))
+    return (0);
+
+  if ((len = strlen(name)) > 0 && name[len - 1] == '.')
+    name[len - 1] = '\0';
+
+  return (name[0] != '\0');
+}
+
+
+//
+// 'hp_list_device()' - List a printer in the CUPS backend format, if it
+//                      is not listed yet
+//
+
+static void
+hp_list_device(device_t *dev,
+	       const char *key,
+	       const char *name)
+{
+  char uri[1024],
+       devid[512],
+       *ptr;
+  const char *model = dev->model;
+  size_t mfglen;
+
+
+  pthread_mutex_lock(&devices_mutex);
+
+  if (dev->listed)
+  {
+    pthread_mutex_unlock(&devices_mutex);
+    return;
+  }
+  dev->listed = 1;
+
+  // Replace the IP address in the URI by the name
+  if (key && (ptr = strstr(dev->uri, "?ip=")) != NULL)
+    snprintf(uri, sizeof(uri), "%.*s?%s=%s", (int)(ptr - dev->uri), dev->uri,
+	     key, name);
+  else
+    snprintf(uri, sizeof(uri), "%s", dev->uri);
+
+  // Device ID from make and model
+  if ((!strncasecmp(model, "Hewlett-Packard", 15) ||
+       !strncasecmp(model, "Hewlett Packard", 15)) && isspace(model[15]))
+    mfglen = 15;
+  else
+    mfglen = strcspn(model, " \t");
+  for (ptr = (char *)model + mfglen; isspace(*ptr); ptr ++);
+  if (!model[mfglen] || !*ptr ||
+      snprintf(devid, sizeof(devid), "MFG:%.*s;MDL:%.*s %s;", (int)mfglen,
+	       model, (int)mfglen, model, ptr) >= (int)sizeof(devid))
+    snprintf(devid, sizeof(devid), "%s", model);
+
+  snprintf(dev->line, sizeof(dev->line),
+	   "network %s \"%s\" \"%s Network %s HPLIP\" \"%s\" \"\"",
+	   uri, model, model, dev->netid, devid);
+
+  if (list_devices)
+  {
+    puts(dev->line);
+    fflush(stdout);
+
+    fprintf(stderr, "DEBUG: %s listed after %.3f sec, %.3f sec for name look-up\n",
+	    uri, hp_time() - start_time, hp_time() - dev->found);
+  }
+
+  pthread_mutex_unlock(&devices_mutex);
+}
+
+
+//
+// 'hp_resolve_device()' - Thread looking up the names of a printer and
+//                         listing it
+//
+
+static void *
+hp_resolve_device(void *arg)
+{
+  device_t *dev = (device_t *)arg;
+  char name[256];
+
+
+  if (!dev->ip[0])
+    hp_list_device(dev, NULL, NULL);
+  else if (hp_zeroconf_name(dev->ip, name, sizeof(name)))
+    hp_list_device(dev, "zc", name);
+  else if (hp_host_name(dev->ip, name, sizeof(name)))
+    hp_list_device(dev, "hostname", name);
+  else
+    hp_list_device(dev, NULL, NULL);
+
+  pthread_mutex_lock(&devices_mutex);
+  num_pending --;
+  pthread_cond_signal(&devices_cond);
+  pthread_mutex_unlock(&devices_mutex);
+
+  return (NULL);
+}
+
+
+//
+// 'hp_parse_line()' - Parse a line of hp-probe output:
+//                     "hp:/net/<Model>?ip=<IP> <Model> <Network ID>"
+//
+
+static device_t *
+hp_parse_line(const char *line)
+{
+  device_t *dev;
+  char uri[1024],
+       model[256],
+       netid[256],
+       *ptr;
+
+
+  if (!strstr(line, "hp:/net/") ||
+      sscanf(line, "%1023s%255s%255s", uri, model, netid) != 3 ||
+      strncmp(uri, "hp:/net/", 8))
+    return (NULL);
+
+  if ((dev = (device_t *)calloc(1, sizeof(device_t))) == NULL)
+    return (NULL);
+
+  snprintf(dev->uri, sizeof(dev->uri), "%s", uri);
+  snprintf(dev->netid, sizeof(dev->netid), "%s", netid);
+  snprintf(dev->model, sizeof(dev->model), "%s", model);
+  for (ptr = dev->model; *ptr; ptr ++)
+    if (*ptr == '_')
+      *ptr = ' ';
+
+  if ((ptr = strstr(dev->uri, "?ip=")) != NULL &&
+      strspn(ptr + 4, "0123456789.") == strlen(ptr + 4) &&
+      snprintf(dev->ip, sizeof(dev->ip), "%s", ptr + 4) >=
+      (int)sizeof(dev->ip))
+    dev->ip[0] = '\0';
+
+  dev->found = hp_time();
+
+  return (dev);
+}
+
+
+//
+// 'hp_probe_has_timeout()' - Check whether the hp-probe command line
+//                            takes the timeout ("%d", and no other "%")
+//
+
+static int
+hp_probe_has_timeout(const char *probe)
+{
+  const char *ptr;
+
+
+  return ((ptr = strchr(probe, '%')) != NULL && ptr[1] == 'd' &&
+	  !strchr(ptr + 2, '%'));
+}
+
+
+//
+// 'hp_probe_round()' - Run hp-probe once, start looking up the names of
+//                      each new printer as soon as hp-probe reports it.
+//                      Returns the number of new printers
+//
+
+static int
+hp_probe_round(const char *probe,
+	       int round,
+	       int timeout,
+	       device_t **devices)
+{
+  FILE *fp;
+  char command[1024],
+       line[2048];
+  device_t *dev,
+           *d;
+  int num_new = 0;
+
+
+  if (hp_probe_has_timeout(probe))
+    snprintf(command, sizeof(command), probe, timeout);
+  else
+    snprintf(command, sizeof(command), "%s", probe);
+
+  if ((fp = popen(command, "r")) == NULL)
+  {
+    fprintf(stderr, "ERROR: Unable to run \"%s\": %s\n", command,
+	    strerror(errno));
+    return (-1);
+  }
+
+  while (fgets(line, sizeof(line), fp))
+  {
+    if ((dev = hp_parse_line(line)) == NULL)
+      continue;
+
+    // Found in an earlier round?
+    for (d = *devices; d; d = d->next)
+      if (!strcmp(d->netid, dev->netid))
+	break;
+    if (d)
+    {
+      free(dev);
+      continue;
+    }
+
+    // hp-probe reports the printers only when its round ends, so the
+    // latency is only known with the round's timeout as granularity
+    fprintf(stderr, "DEBUG: %s answered in round %d, within its %d sec timeout (round granularity)\n",
+	    dev->uri, round, timeout);
+
+    dev->next = *devices;
+    *devices  = dev;
+    num_new ++;
+
+    pthread_mutex_lock(&devices_mutex);
+    num_pending ++;
+    pthread_mutex_unlock(&devices_mutex);
+
+    if (pthread_create(&dev->tid, NULL, hp_resolve_device, dev))
+    {
+      pthread_mutex_lock(&devices_mutex);
+      num_pending --;
+      pthread_mutex_unlock(&devices_mutex);
+      hp_list_device(dev, NULL, NULL);
+    }
+    else
+      pthread_detach(dev->tid);
+  }
+
+  if (pclose(fp))
+    fprintf(stderr, "DEBUG: \"%s\" exited with error\n", command);
+
+  return (num_new);
+}
+
+
+//
+// 'hp_discover()' - Find the network printers with hp-probe, list each
+//                   as soon as its names are looked up
+//
+
+static device_t *
+hp_discover(const char *probe)
+{
+  device_t *devices = NULL,
+           *dev;
+  struct timespec deadline;
+  const char *val;
+  int timeout = PROBE_TIMEOUT,
+      min = PROBE_MIN,
+      quiet = PROBE_QUIET,
+      elapsed = 0,
+      silent = 0,
+      round = 1,
+      rounds = 0,
+      num_new;
+  double now,
+         round_start;
+
+
+  if ((val = getenv("HP_PROBE_TIMEOUT")) != NULL && atoi(val) > 0)
+    timeout = atoi(val);
+  if ((val = getenv("HP_PROBE_MIN")) != NULL && val[0])
+    min = atoi(val);
+  if ((val = getenv("HP_PROBE_QUIET")) != NULL && atoi(val) > 0)
+    quiet = atoi(val);
+  if (min > timeout)
+    min = timeout;
+
+  // Rounds of 1, 2, 4, ... seconds, so that the printers which answer
+  // quickly get listed right away and the later rounds give the slow
+  // ones more time. Probing goes on for at least the minimum time and
+  // stops when the rounds since the last new printer took the quiet
+  // period, or at the timeout. Commands without timeout run once, each
+  // round starts hp-probe (Python) anew
+  do
+  {
+    if (round > timeout - elapsed)
+      round = timeout - elapsed;
+    round_start = hp_time();
+    if ((num_new = hp_probe_round(probe, rounds + 1, round, &devices)) < 0)
+      break;
+    elapsed += round;
+    silent = num_new > 0 ? 0 : silent + round;
+    rounds ++;
+    // The time beyond the timeout is the start-up of hp-probe
+    fprintf(stderr, "DEBUG: Round %d of hp-probe (%d sec): %.3f sec, %d new printer(s)\n",
+	    rounds, round, hp_time() - round_start, num_new);
+    round *= 2;
+  }
+  while (hp_probe_has_timeout(probe) && elapsed < timeout &&
+	 (elapsed < min || silent < quiet));
+
+  fprintf(stderr, "DEBUG: %d round(s) of hp-probe, %d sec\n", rounds,
+	  elapsed);
+
+  // Host name look-ups have no timeout of their own, list the printers
+  // which still do not have a name with their IP address
+  now = hp_time();
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 2 * resolve_timeout + 1;
+
+  pthread_mutex_lock(&devices_mutex);
+  while (num_pending > 0)
+    if (pthread_cond_timedwait(&devices_cond, &devices_mutex, &deadline) ==
+	ETIMEDOUT)
+      break;
+  pthread_mutex_unlock(&devices_mutex);
+
+  for (dev = devices; dev; dev = dev->next)
+    hp_list_device(dev, NULL, NULL);
+
+  fprintf(stderr, "DEBUG: Discovery took %.3f sec, %.3f sec after hp-probe finished\n",
+	  hp_time() - start_time, hp_time() - now);
+
+  return (devices);
+}
+
+
+//
+// 'hp_cache_read()' - Read the cache, without the printers not seen
+//                     within the TTL, and the time of the last probe
+//                     (0 if unknown)
+//
+
+static cache_entry_t *
+hp_cache_read(const char *cachefile,
+	      int ttl,
+	      time_t *probed)
+{
+  FILE *fp;
+  char line[4608];
+  cache_entry_t *entries = NULL,
+                *entry;
+  long seen;
+  int pos;
+  time_t now = time(NULL);
+
+
+  if (probed)
+    *probed = 0;
+
+  if ((fp = fopen(cachefile, "r")) == NULL)
+    return (NULL);
+
+  // First line: "probed <Time of the last probe>", so that also a probe
+  // which found no printer counts
+  // Lines: "<Time last seen> <Network ID> <Line in the device list>"
+  while (fgets(line, sizeof(line), fp))
+  {
+    line[strcspn(line, "\n")] = '\0';
+    if (!strncmp(line, "probed ", 7))
+    {
+      if (probed)
+	*probed = (time_t)atol(line + 7);
+      continue;
+    }
+    if ((entry = (cache_entry_t *)calloc(1, sizeof(cache_entry_t))) == NULL)
+      break;
+    if (sscanf(line, "%ld%255s %n", &seen, entry->netid, &pos) != 2 ||
+	now - seen > ttl)
+    {
+      free(entry);
+      continue;
+    }
+    entry->seen = (time_t)seen;
+    snprintf(entry->line, sizeof(entry->line), "%s", line + pos);
+    entry->next = entries;
+    entries     = entry;
+  }
+
+  fclose(fp);
+
+  return (entries);
+}
+
+
+//
+// 'hp_cache_write()' - Update the cache with the printers just found
+//
+
+static void
+hp_cache_write(const char *cachefile,
+	       device_t *devices,
+	       int ttl)
+{
+  cache_entry_t *entries,
+                *entry;
+  device_t *dev;
+  char tempfile[1024];
+  FILE *fp;
+  time_t now = time(NULL);
+
+
+  entries = hp_cache_read(cachefile, ttl, NULL);
+
+  snprintf(tempfile, sizeof(tempfile), "%s.%d", cachefile, (int)getpid());
+  if ((fp = fopen(tempfile, "w")) == NULL)
+    return;
+
+  fprintf(fp, "probed %ld\n", (long)now);
+
+  for (dev = devices; dev; dev = dev->next)
+    if (dev->line[0])
+      fprintf(fp, "%ld %s %s\n", (long)now, dev->netid, dev->line);
+
+  // Printers not found this time, but seen within the TTL
+  for (entry = entries; entry; entry = entry->next)
+  {
+    for (dev = devices; dev; dev = dev->next)
+      if (!strcmp(dev->netid, entry->netid))
+	break;
+    if (!dev)
+      fprintf(fp, "%ld %s %s\n", (long)entry->seen, entry->netid,
+	      entry->line);
+  }
+
+  if (fclose(fp) || rename(tempfile, cachefile))
+    unlink(tempfile);
+
+  while ((entry = entries) != NULL)
+  {
+    entries = entry->next;
+    free(entry);
+  }
+}
+
+
+//
+// 'hp_cache_refresh()' - Refresh the cache in a background process, if
+//                        no other one is doing this already
+//
+
+static void
+hp_cache_refresh(const char *cachefile,
+		 const char *probe,
+		 int ttl)
+{
+  char lockfile[1024];
+  int lockfd, nullfd;
+  pid_t pid;
+
+
+  if (snprintf(lockfile, sizeof(lockfile), "%s.lock", cachefile) >=
+      (int)sizeof(lockfile) ||
+      (lockfd = open(lockfile, O_RDWR | O_CREAT, 0600)) < 0)
+    return;
+  if (flock(lockfd, LOCK_EX | LOCK_NB))
+  {
+    // Other refresh running
+    close(lockfd);
+    return;
+  }
+
+  if ((pid = fork()) == 0)
+  {
+    // Detach from the Printer Application, which waits for our output
+    // to end
+    setsid();
+    if ((nullfd = open("/dev/null", O_RDWR)) >= 0)
+    {
+      dup2(nullfd, 0);
+      dup2(nullfd, 1);
+      dup2(nullfd, 2);
+    }
+
+    list_devices = 0;
+    hp_cache_write(cachefile, hp_discover(probe), ttl);
+    _exit(0);
+  }
+
+  // The child keeps the lock
+  close(lockfd);
+  if (pid > 0)
+    fputs("DEBUG: Listed printers from cache, refreshing in the background\n",
+	  stderr);
+}
+
+
+//
+// 'main()' - List the network printers found by hp-probe
+//
+
+int
+main(int  argc,				// I - Number of command-line arguments
+     char *argv[])			// I - Command-line arguments
+{
+  const char *probe,
+             *val;
+  char cachefile[1024];
+  cache_entry_t *entries,
+                *entry;
+  time_t probed;
+  int refresh = CACHE_REFRESH,
+      ttl = CACHE_TTL;
+
+
+  (void)argc;
+  (void)argv;
+
+  start_time = hp_time();
+
+  if ((probe = getenv("HP_PROBE")) == NULL || !probe[0])
+  {
+    probe = PROBE_COMMAND;
+    if (!hp_in_path("hp-probe"))
+    {
+      fputs("ERROR: \"hp-probe\" (HPLIP) not found\n", stderr);
+      return (1);
+    }
+  }
+
+  if ((val = getenv("HP_RESOLVER")) != NULL && val[0])
+    resolver = val;
+  else if (!hp_in_path(resolver))
+    fprintf(stderr, "WARNING: \"%s\" not found, URIs will use host name or IP address instead of ZeroConf name\n", resolver);
+
+  if ((val = getenv("HP_RESOLVE_TIMEOUT")) != NULL && atoi(val) > 0)
+    resolve_timeout = atoi(val);
+  if ((val = getenv("HP_CACHE_REFRESH")) != NULL && val[0])
+    refresh = atoi(val);
+  if ((val = getenv("HP_CACHE_TTL")) != NULL && val[0])
+    ttl = atoi(val);
+
+  if ((val = getenv("HP_CACHE")) != NULL)
+    snprintf(cachefile, sizeof(cachefile), "%s", val);
+  else if ((val = getenv("STATE_DIR")) != NULL && val[0])
+    snprintf(cachefile, sizeof(cachefile), "%s/%s", val, CACHE_FILE);
+  else
+    snprintf(cachefile, sizeof(cachefile), "%s/%s", STATE_DIR, CACHE_FILE);
+
+  if (!cachefile[0] || ttl <= 0)
+  {
+    // No cache
+    hp_discover(probe);
+    return (0);
+  }
+
+  // List the printers from the cache if it is recent, also if the last
+  // probe did not find any, refresh it in the background when it is
+  // getting old
+  entries = hp_cache_read(cachefile, ttl, &probed);
+  if (probed > 0 && time(NULL) - probed <= ttl)
+  {
+    for (entry = entries; entry; entry = entry->next)
+      puts(entry->line);
+    fflush(stdout);
+
+    if (time(NULL) - probed >= refresh)
+      hp_cache_refresh(cachefile, probe, ttl);
+
+    return (0);
+  }
+
+  hp_cache_write(cachefile, hp_discover(probe), ttl);
+
+  // Threads which are still waiting for a look-up end with the process
+  return (0);
+}
@@ -22,7 +22,20 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
 #include <dirent.h>
+#include <avahi-client/client.h>
+#include <avahi-client/lookup.h>
+#include <avahi-common/thread-watch.h>
+#include <avahi-common/error.h>
+#include <avahi-common/malloc.h>
+#include <pthread.h>
 
 //
 // Constants...
@@ -52,6 +65,10 @@
 // Test page
 
 #define TESTPAGE "testpage.pdf"
+#define TESTPAGE_ALT "testpage.ps"          // Installed by "make install"
+#ifndef TESTPAGE_DIR
+#  define TESTPAGE_DIR "/usr/share/hplip-printer-app"
+#endif
 
 // System architecture
 
@@ -73,6 +90,103 @@
 #define PLUGIN_CONF_URL "http://hplip.sf.net/plugin.conf"
 #define PLUGIN_ALT_LOCATION "https://developers.hp.com/sites/default/files"
 
+// State directory, if not supplied via the STATE_DIR environment variable
+
+#ifndef STATE_DIR
+#  define STATE_DIR "/var/lib/hplip-printer-app"
+#endif
+
+// Measured times of the spooling conversions
+
+#define CONVERSION_STATS_DIR "conversions"  // Sub-directory of state directory
+#define CONVERSION_STATS_MAX 64             // Max. entries per printer
+#define CONVERSION_STATS_WEIGHT 0.3         // Weight of newest job in average
+#define CONVERSION_RECENT_JOBS 20           // Recent jobs shown with their
+                                            // wait for the scheduler
+#define CONVERSION_QUEUE_MAX (32 * 1024 * 1024)
+                                            // Max. conversion output to
+                                            // hold while the driver is busy
+
+// Spool directory, if not supplied via the SPOOL_DIR environment variable
+
+#ifndef SPOOL_DIR
+#  define SPOOL_DIR "/var/spool/hplip-printer-app"
+#endif
+
+// Cache for rendered jobs
+
+#define RENDER_CACHE_DIR "render-cache"     // Sub-directory of spool directory
+#define RENDER_CACHE_SIZE 0                 // Default size limit in MB, can
+                                            // be changed with the
+                                            // RENDER_CACHE_SIZE environment
+                                            // variable, 0 only keeps the
+                                            // test page
+#define RENDER_CACHE_TESTPAGE "testpage-" // Prefix for entries of the test
+                                            // page, these never get evicted
+#define RENDER_CACHE_TEMP_AGE 86400         // Age in seconds after which a
+                                            // temporary file of a filter
+                                            // gets removed, also if its PID
+                                            // is in use again
+
+// Polling of supply levels and printer status via SNMP
+
+#define SNMP_COMMUNITY "public"             // SNMP_COMMUNITY environment
+                                            // variable, "" = no polling
+#define SNMP_PORT "161"                     // SNMP_PORT environment
+                                            // variable, for testing
+#define SNMP_INTERVAL_BUSY 15               // Seconds between polls while
+                                            // printing
+#define SNMP_INTERVAL_IDLE 300              // Seconds between polls when
+                                            // idle
+#define SNMP_TIMEOUT 5                      // Seconds to wait for answers
+#define SNMP_MAX_SUPPLIES 16                // Max. supplies per printer
+#define SNMP_MAX_VALUES 128                 // Max. values in an answer
+
+// Discovery of network printers via DNS-SD
+
+#define DNSSD_SERVICES "_pdl-datastream._tcp"
+                                            // DNSSD_SERVICES environment
+                                            // variable, comma-separated,
+                                            // "" = no DNS-SD discovery
+#define DNSSD_MAX_SERVICES 4                // Max. service types browsed
+
+// Metrics for the "/metrics" web resource
+
+#define METRICS_SHARDS 16                   // Counter shards, each thread
+                                            // adds to its own
+#define METRICS_MAX_PRINTERS 64             // Max. printers with metrics
+#define METRICS_MAX_CONVERSIONS 8           // Max. conversions with metrics
+#define METRICS_BUCKETS { 0.1, 0.5, 1.0, 5.0, 15.0, 60.0, 300.0 }
+                                            // Histogram buckets (seconds)
+#define METRICS_NUM_BUCKETS 7
+
+// Tracing of the jobs through conversion, driver, and backend
+
+#define TRACE_DIR "traces"                  // Sub-directory of state dir
+#define TRACE_JOBS 0                        // TRACE_JOBS environment
+                                            // variable, traces kept per
+                                            // printer, 0 = no tracing
+#define TRACE_FILE "trace.json"             // Rolling file with the
+                                            // events of all jobs
+#define TRACE_FILE_SIZE 16                  // TRACE_FILE_SIZE environment
+                                            // variable, MB before the
+                                            // rolling file gets rotated,
+                                            // 0 = no rolling file
+#define JOB_TIMES 256                       // Jobs in progress of which
+                                            // the creation and start of
+                                            // processing are kept
+
+// Scheduling of the conversions of all printers
+
+#define SCHEDULER_MAX_ENTRIES 256           // Max. conversions running or
+                                            // waiting, more run unscheduled
+#define SCHEDULER_AGING 1.0                 // Seconds of expected conversion
+                                            // time a job gains per second
+                                            // waited
+#define SCHEDULER_BYTES_PER_SEC (1024 * 1024)
+                                            // Assumed conversion speed for
+                                            // not yet measured conversions
+
 
 //
 // Types...
@@ -85,6 +199,282 @@ typedef enum hplip_plugin_status_e
   HPLIP_PLUGIN_INSTALLED
 } hplip_plugin_status_t;
 
+typedef struct hplip_conversion_s	// Wrapped spooling conversion
+{
+  const pr_spooling_conversion_t *orig;	// Conversion of pappl-retrofit
+  cups_array_t	*filters,		// Its filters, for cfFilterChain()
+		*traced_filters;	// The same, wrapped for tracing
+} hplip_conversion_t;
+
+typedef struct hplip_conversion_job_s	// Data of a running conversion
+{
+  hplip_conversion_t *conversion;	// Conversion
+  int		inputfd,		// Input file
+		outputfd,		// Pipe to hplip_conversion_filter()
+		inputseekable;		// Is input seekable?
+  cf_filter_data_t *data;		// Filter data of the job
+  int		traced,			// Is the job traced?
+		status;			// Exit status of the filters
+} hplip_conversion_job_t;
+
+typedef struct hplip_chunk_s		// Chunk of conversion output
+{
+  struct hplip_chunk_s *next;		// Next chunk in the queue
+  size_t	len;			// Number of bytes in the chunk
+  char		data[65536];		// Data
+} hplip_chunk_t;
+
+typedef struct hplip_pipeline_s		// Output queue between conversion
+					// and driver
+{
+  pthread_mutex_t mutex;		// Lock for the queue
+  pthread_cond_t cond;			// Signals queue changes
+  int		fd;			// Output pipe of the conversion
+  hplip_chunk_t	*first,			// Oldest chunk in the queue
+		*last;			// Newest chunk in the queue
+  size_t	queued;			// Bytes in the queue
+  int		eof,			// Conversion has finished
+		failed,			// Driver does not take data any more
+		nomem,			// Out of memory for the queue
+		slot;			// Entry in the scheduler, -1 if none
+  double	stalled;		// Time the conversion waited for
+					// space in the queue
+  size_t	total;			// Bytes sent to the driver
+  double	first_write,		// Time of the first data sent
+		last_write,		// Time of the last data sent
+		blocked,		// Time the driver took to take it
+		idle;			// Time the driver waited for data
+} hplip_pipeline_t;
+
+typedef struct hplip_cache_job_s	// Use of the render cache by a job
+{
+  char		key[sizeof(RENDER_CACHE_TESTPAGE) + 2 * SHA256_DIGEST_LENGTH],
+					// Key of the job's output
+		file[1024],		// Cache file
+		tempfile[1024];		// File being written, "" if none
+  int		fd,			// Cache file or file being written,
+					// -1 if none
+		keep,			// Keep the output for repeated jobs?
+		failed;			// Writing the output failed
+  off_t		size;			// Size limit of the cache
+} hplip_cache_job_t;
+
+typedef struct hplip_conversion_stats_s	// Measured time of a conversion
+{
+  char		srctype[64],		// Input format
+		dsttype[64],		// Output format
+		jobclass[32];		// Class of the jobs measured
+  int		runs;			// Number of jobs measured
+  double	seconds,		// Average conversion time
+		bytes,			// Average output size
+		blocked;		// Average time waiting for the driver
+					// and backend to take the output
+} hplip_conversion_stats_t;
+
+typedef struct hplip_conversion_recent_s	// Recent job of a printer
+{
+  int		job_id;			// Job ID
+  char		jobclass[32];		// Class of the job
+  double	waited,			// Time waited for the scheduler
+		seconds;		// Conversion time
+  int		status;			// Exit status of the conversion
+} hplip_conversion_recent_t;
+
+typedef struct hplip_sched_entry_s	// Conversion in the scheduler
+{
+  pid_t		pid;			// Process, 0 = free entry
+  int		running;		// Running or waiting?
+  double	cost,			// Expected conversion time
+		since;			// Time when it started waiting
+} hplip_sched_entry_t;
+
+typedef struct hplip_scheduler_s	// Scheduler, in memory shared with
+					// the filter processes
+{
+  pthread_mutex_t mutex;		// Lock for the entries
+  pthread_cond_t cond;			// Signals when a conversion finishes
+  int		max_running;		// Max. conversions at a time
+  hplip_sched_entry_t entries[SCHEDULER_MAX_ENTRIES];
+					// Running and waiting conversions
+} hplip_scheduler_t;
+
+typedef struct hplip_snmp_value_s	// Value in an SNMP answer
+{
+  int		oid[32],		// Object ID
+		oidlen,			// Number of components of the OID
+		type;			// ASN.1 type
+  long		integer;		// Value of numbers
+  char		string[256];		// Value of strings
+  int		stringlen;		// Length of the string
+} hplip_snmp_value_t;
+
+typedef struct hplip_snmp_lookup_s	// Look-up of a printer's address
+					// in a separate thread
+{
+  char		host[256],		// Host name
+		port[16];		// UDP port
+  struct sockaddr_storage addr;		// Address
+  socklen_t	addrlen;		// Length of the address, 0 = not
+					// found
+  int		done,			// Look-up finished?
+		refs;			// References (printer and thread)
+} hplip_snmp_lookup_t;
+
+typedef struct hplip_snmp_printer_s	// Printer polled via SNMP
+{
+  int		id,			// Printer ID
+		seen;			// Still in the system?
+  char		host[256];		// Host name or IP address
+  struct sockaddr_storage addr;		// Address
+  socklen_t	addrlen;		// Length of the address, 0 = not
+					// looked up yet
+  hplip_snmp_lookup_t *lookup;		// Running look-up, if any
+  unsigned	request_id;		// Request ID of the last poll
+  int		answers,		// Answers received (bits)
+		failures;		// Polls without answer in a row
+  double	next_poll,		// Time for the next poll
+		sent;			// Time of the last poll, 0 if answered
+  int		status;			// hrPrinterStatus
+  unsigned char	error_state[2];		// hrPrinterDetectedErrorState
+  pappl_preason_t reasons;		// State reasons set by the poller
+  int		num_supplies,		// Number of supplies
+		supply_class[SNMP_MAX_SUPPLIES],
+					// prtMarkerSuppliesClass
+		supply_type[SNMP_MAX_SUPPLIES],
+					// prtMarkerSuppliesType
+		supply_colorant[SNMP_MAX_SUPPLIES],
+					// prtMarkerSuppliesColorantIndex
+		supply_max[SNMP_MAX_SUPPLIES],
+					// prtMarkerSuppliesMaxCapacity
+		supply_level[SNMP_MAX_SUPPLIES];
+					// prtMarkerSuppliesLevel
+  char		supply_description[SNMP_MAX_SUPPLIES][64],
+					// prtMarkerSuppliesDescription
+		colorant[SNMP_MAX_SUPPLIES][32];
+					// prtMarkerColorantValue
+} hplip_snmp_printer_t;
+
+typedef struct hplip_snmp_poller_s	// SNMP supply level poller
+{
+  pappl_system_t *system;		// System
+  const char	*community,		// SNMP community
+		*port;			// UDP port of the printers
+  hplip_snmp_printer_t *printers;	// Polled printers
+  int		num_printers,		// Number of printers
+		alloc_printers;		// Allocated entries
+} hplip_snmp_poller_t;
+
+typedef struct hplip_dnssd_service_s	// Printer service found via DNS-SD
+{
+  char		name[256],		// Service instance name
+		type[32],		// Service type
+		domain[64],		// Domain
+		address[64],		// IPv4 or IPv6 address, link-local
+					// IPv6 ones with "%<Interface>"
+		make_and_model[256],	// Make and model ("ty" TXT record)
+		device_id[256];		// IEEE-1284 device ID
+  int		port;			// Port
+  AvahiIfIndex	interface;		// Network interface
+  AvahiProtocol	protocol;		// IPv4 or IPv6
+} hplip_dnssd_service_t;
+
+typedef struct hplip_dnssd_browser_s	// Long-lived DNS-SD browser
+{
+  pthread_mutex_t mutex;		// Lock for the service table
+  pappl_system_t *system;		// System
+  AvahiThreadedPoll *poll;		// Avahi event loop thread
+  AvahiClient	*client;		// Connection to avahi-daemon
+  char		types[DNSSD_MAX_SERVICES][32];
+					// Browsed service types
+  AvahiServiceBrowser *browsers[DNSSD_MAX_SERVICES];
+					// One browser per service type
+  int		num_types;		// Number of service types
+  hplip_dnssd_service_t *services;	// Services currently on the network
+  int		num_services,		// Number of services
+		alloc_services;		// Allocated entries
+} hplip_dnssd_browser_t;
+
+typedef struct hplip_cache_entry_s	// Entry of the render cache
+{
+  char		name[80];		// File name
+  off_t		size;			// File size
+  time_t	used;			// Last use
+} hplip_cache_entry_t;
+
+typedef enum hplip_metric_e		// Counters of the system
+{
+  HPLIP_METRIC_CACHE_HITS,		// Render cache hits
+  HPLIP_METRIC_CACHE_MISSES,		// Render cache misses
+  HPLIP_METRIC_CACHE_BYTES,		// Bytes sent from the render cache
+  HPLIP_METRIC_CACHE_COPIED,		// Of them copied in user space
+  HPLIP_METRIC_SCHED_WAITS,		// Conversions waiting for others
+  HPLIP_METRIC_SCHED_WAIT_USEC,		// Time waited for others
+  HPLIP_METRIC_DNSSD_LISTS,		// Listings of the DNS-SD browser
+  HPLIP_METRIC_DNSSD_LIST_USEC,		// Time for them
+					// Plugin phases, each one followed
+					// by the failed ones and the time
+  HPLIP_METRIC_PLUGIN_DOWNLOAD_FILE,
+  HPLIP_METRIC_PLUGIN_DOWNLOAD = HPLIP_METRIC_PLUGIN_DOWNLOAD_FILE + 3,
+  HPLIP_METRIC_PLUGIN_INSTALL = HPLIP_METRIC_PLUGIN_DOWNLOAD + 3,
+  HPLIP_METRIC_PLUGIN_REMOVE = HPLIP_METRIC_PLUGIN_INSTALL + 3,
+  HPLIP_METRIC_MAX = HPLIP_METRIC_PLUGIN_REMOVE + 3
+} hplip_metric_t;
+
+typedef struct hplip_histogram_s	// Histogram of durations
+{
+  unsigned long long count,		// Number of durations
+		usec,			// Sum of durations in microseconds
+		buckets[METRICS_NUM_BUCKETS + 1];
+					// Durations per bucket, the last one
+					// for the longer ones
+} hplip_histogram_t;
+
+typedef struct hplip_printer_metrics_s	// Counters of a printer
+{
+  unsigned long long jobs,		// Successful jobs
+		failed,			// Failed jobs
+		bytes,			// Bytes sent to driver and backend
+		send_usec,		// Time waited for them to take it
+		idle_usec,		// Time they waited for the conversion
+		stall_usec;		// Time the conversion waited for them
+  hplip_histogram_t duration;		// Durations of successful jobs
+} hplip_printer_metrics_t;
+
+typedef struct hplip_metrics_shard_s	// Counters of some of the threads,
+					// only counters, they get added up
+					// as a whole
+{
+  unsigned long long counters[HPLIP_METRIC_MAX];
+					// Counters of the system
+  hplip_printer_metrics_t printers[METRICS_MAX_PRINTERS];
+					// Counters per printer
+  hplip_histogram_t conversions[METRICS_MAX_CONVERSIONS];
+					// Durations per conversion
+} __attribute__((aligned(64))) hplip_metrics_shard_t;
+
+typedef struct hplip_metrics_s		// Metrics, in memory shared with
+					// the filter processes
+{
+  pthread_mutex_t mutex;		// Lock for adding labels
+  int		next_shard,		// Shard for the next thread
+		num_printers,		// Number of printers
+		num_conversions;	// Number of conversions
+  char		printers[METRICS_MAX_PRINTERS][128],
+					// Printer names
+		conversions[METRICS_MAX_CONVERSIONS][128];
+					// Conversion names
+  hplip_metrics_shard_t shards[METRICS_SHARDS];
+					// Counters
+} hplip_metrics_t;
+
+typedef struct hplip_job_times_s	// Times of a job in progress, for
+					// its duration and trace
+{
+  int		job_id;			// Job ID, 0 = free entry
+  double	created,		// Job created
+		processing;		// Start of processing, 0.0 = not yet
+} hplip_job_times_t;
+
 
 //
 // Functions...
@@ -310,6 +700,334 @@ set_config_value(char **filebuf,
 }
 
 
+//
+// 'hplip_time()' - Return a monotonic time stamp in seconds
+//
+
+double
+hplip_time(void)
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0);
+}
+
+
+//
+// 'hplip_mutex_init()' - Initialize a mutex in memory shared with the
+//                        filter processes. It is robust, as filter
+//                        processes get killed when their job gets
+//                        canceled, possibly while holding it
+//
+
+void
+hplip_mutex_init(pthread_mutex_t *mutex)
+{
+  pthread_mutexattr_t mutexattr;
+
+
+  pthread_mutexattr_init(&mutexattr);
+  pthread_mutexattr_setpshared(&mutexattr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutexattr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(mutex, &mutexattr);
+  pthread_mutexattr_destroy(&mutexattr);
+}
+
+
+//
+// 'hplip_mutex_lock()' - Lock a mutex created by hplip_mutex_init(),
+//                        taking it over if its owner died. The data
+//                        it protects only gets changed by single,
+//                        complete assignments, so it stays usable
+//
+
+void
+hplip_mutex_lock(pthread_mutex_t *mutex)
+{
+  if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+    pthread_mutex_consistent(mutex);
+}
+
+
+//
+// 'hplip_metrics()' - Get the metrics, creating them in memory shared
+//                     with the filter processes on the first call
+//
+
+hplip_metrics_t *
+hplip_metrics(void)
+{
+  static hplip_metrics_t *metrics = NULL;
+
+
+  if (metrics)
+    return (metrics);
+
+  if ((metrics = (hplip_metrics_t *)
+       mmap(NULL, sizeof(hplip_metrics_t), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+  {
+    metrics = NULL;
+    return (NULL);
+  }
+  memset(metrics, 0, sizeof(hplip_metrics_t));
+
+  hplip_mutex_init(&metrics->mutex);
+
+  return (metrics);
+}
+
+
+//
+// 'hplip_metrics_shard()' - Get the shard of the counters the calling
+//                           thread adds to, so that threads do not
+//                           compete for the same cache lines
+//
+
+hplip_metrics_shard_t *
+hplip_metrics_shard(void)
+{
+  static __thread int shard = -1;
+  hplip_metrics_t *metrics;
+
+
+  if ((metrics = hplip_metrics()) == NULL)
+    return (NULL);
+
+  if (shard < 0)
+    shard = __atomic_fetch_add(&metrics->next_shard, 1, __ATOMIC_RELAXED) %
+      METRICS_SHARDS;
+
+  return (&metrics->shards[shard]);
+}
+
+
+//
+// 'hplip_metrics_label()' - Get the index of a label value (printer
+//                           or conversion), adding it if needed, -1 if
+//                           there is no space left
+//
+
+int
+hplip_metrics_label(char (*labels)[128],
+		    int *num_labels,
+		    int max_labels,
+		    const char *value)
+{
+  hplip_metrics_t *metrics;
+  int i, num;
+
+
+  if ((metrics = hplip_metrics()) == NULL || !value)
+    return (-1);
+
+  // Labels only get added, so look them up without locking
+  num = __atomic_load_n(num_labels, __ATOMIC_ACQUIRE);
+  for (i = 0; i < num; i ++)
+    if (!strcmp(labels[i], value))
+      return (i);
+
+  hplip_mutex_lock(&metrics->mutex);
+  for (i = 0; i < *num_labels; i ++)
+    if (!strcmp(labels[i], value))
+      break;
+  if (i == *num_labels)
+  {
+    if (i < max_labels)
+    {
+      snprintf(labels[i], sizeof(labels[i]), "%s", value);
+      __atomic_store_n(num_labels, i + 1, __ATOMIC_RELEASE);
+    }
+    else
+      i = -1;
+  }
+  pthread_mutex_unlock(&metrics->mutex);
+
+  return (i);
+}
+
+
+//
+// 'hplip_metrics_add()' - Add to a counter
+//
+
+void
+hplip_metrics_add(unsigned long long *counter,
+		  unsigned long long value)
+{
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+
+//
+// 'hplip_metrics_observe()' - Add a duration to a histogram
+//
+
+void
+hplip_metrics_observe(hplip_histogram_t *histogram,
+		      double seconds)
+{
+  static const double bounds[METRICS_NUM_BUCKETS] = METRICS_BUCKETS;
+  int i;
+
+
+  for (i = 0; i < METRICS_NUM_BUCKETS && seconds > bounds[i]; i ++);
+  hplip_metrics_add(&histogram->buckets[i], 1);
+  hplip_metrics_add(&histogram->count, 1);
+  hplip_metrics_add(&histogram->usec,
+		    (unsigned long long)(seconds * 1000000.0));
+}
+
+
+//
+// 'hplip_metrics_count()' - Count an event of the system and its
+//                           duration
+//
+
+void
+hplip_metrics_count(hplip_metric_t metric,
+		    hplip_metric_t usec_metric,
+		    double seconds)
+{
+  hplip_metrics_shard_t *shard;
+
+
+  if ((shard = hplip_metrics_shard()) == NULL)
+    return;
+
+  hplip_metrics_add(&shard->counters[metric], 1);
+  if (usec_metric != metric)
+    hplip_metrics_add(&shard->counters[usec_metric],
+		      (unsigned long long)(seconds * 1000000.0));
+}
+
+
+//
+// 'hplip_metrics_plugin()' - Count a phase of downloading, installing,
+//                            or removing the plugin
+//
+
+void
+hplip_metrics_plugin(hplip_metric_t phase,
+		     double start,
+		     int ok)
+{
+  hplip_metrics_shard_t *shard;
+
+
+  if ((shard = hplip_metrics_shard()) == NULL)
+    return;
+
+  hplip_metrics_add(&shard->counters[phase + (ok ? 0 : 1)], 1);
+  hplip_metrics_add(&shard->counters[phase + 2],
+		    (unsigned long long)((hplip_time() - start) * 1000000.0));
+}
+
+
+//
+// 'hplip_metrics_job()' - Count a job converted and sent to a printer
+//
+
+void
+hplip_metrics_job(const char *printer,
+		  const pr_spooling_conversion_t *conversion,
+		  int ok,
+		  double conversion_seconds,
+		  size_t bytes,
+		  double send_seconds,
+		  double idle_seconds,
+		  double stall_seconds)
+{
+  hplip_metrics_t *metrics;
+  hplip_metrics_shard_t *shard;
+  hplip_printer_metrics_t *p;
+  char name[128];
+  int i;
+
+
+  if ((metrics = hplip_metrics()) == NULL ||
+      (shard = hplip_metrics_shard()) == NULL)
+    return;
+
+  if ((i = hplip_metrics_label(metrics->printers, &metrics->num_printers,
+			       METRICS_MAX_PRINTERS, printer)) >= 0)
+  {
+    p = &shard->printers[i];
+    hplip_metrics_add(ok ? &p->jobs : &p->failed, 1);
+    hplip_metrics_add(&p->bytes, bytes);
+    hplip_metrics_add(&p->send_usec,
+		      (unsigned long long)(send_seconds * 1000000.0));
+    hplip_metrics_add(&p->idle_usec,
+		      (unsigned long long)(idle_seconds * 1000000.0));
+    hplip_metrics_add(&p->stall_usec,
+		      (unsigned long long)(stall_seconds * 1000000.0));
+  }
+
+  if (conversion && ok && conversion_seconds >= 0.0)
+  {
+    snprintf(name, sizeof(name), "%s -> %s", conversion->srctype,
+	     conversion->dsttype);
+    if ((i = hplip_metrics_label(metrics->conversions,
+				 &metrics->num_conversions,
+				 METRICS_MAX_CONVERSIONS, name)) >= 0)
+      hplip_metrics_observe(&shard->conversions[i], conversion_seconds);
+  }
+}
+
+
+//
+// 'hplip_metrics_job_duration()' - Count the duration of a successful
+//                                  job, from its creation until its
+//                                  completion
+//
+
+void
+hplip_metrics_job_duration(const char *printer,
+			   double seconds)
+{
+  hplip_metrics_t *metrics;
+  hplip_metrics_shard_t *shard;
+  int i;
+
+
+  if ((metrics = hplip_metrics()) == NULL ||
+      (shard = hplip_metrics_shard()) == NULL)
+    return;
+
+  if ((i = hplip_metrics_label(metrics->printers, &metrics->num_printers,
+			       METRICS_MAX_PRINTERS, printer)) >= 0)
+    hplip_metrics_observe(&shard->printers[i].duration, seconds);
+}
+
+
+//
+// 'hplip_metrics_escape()' - Escape a label value for the metrics
+//
+
+const char *
+hplip_metrics_escape(const char *value,
+		     char *buf,
+		     size_t bufsize)
+{
+  char *ptr,
+       *end = buf + bufsize - 2;
+
+
+  for (ptr = buf; *value && ptr < end; value ++)
+  {
+    if (*value == '\\' || *value == '\"' || *value == '\n')
+      *ptr++ = '\\';
+    *ptr++ = (*value == '\n' ? 'n' : *value);
+  }
+  *ptr = '\0';
+
+  return (buf);
+}
+
+
 //
 // 'hplip_version()' - Read out the HPLIP version from /etc/hp/hplip.conf
 //
@@ -408,6 +1126,7 @@ hplip_download_file(pappl_system_t *system, const char *url)
   CURL *curl;
   FILE *fp = NULL;
   CURLcode ret;
+  double start = hplip_time();
 
 
   papplLog(system, PAPPL_LOGLEVEL_DEBUG,
@@ -423,6 +1142,7 @@ hplip_download_file(pappl_system_t *system, const char *url)
     {
       papplLog(system, PAPPL_LOGLEVEL_ERROR,
 	       "Unable to create temporary file");
+      hplip_metrics_plugin(HPLIP_METRIC_PLUGIN_DOWNLOAD_FILE, start, 0);
       return (NULL);
     }
 
@@ -443,9 +1163,13 @@ hplip_download_file(pappl_system_t *system, const char *url)
   {
     papplLog(system, PAPPL_LOGLEVEL_ERROR,
 	     "Unable to start curl");
+    hplip_metrics_plugin(HPLIP_METRIC_PLUGIN_DOWNLOAD_FILE, start, 0);
     return (NULL);
   }
 
+  hplip_metrics_plugin(HPLIP_METRIC_PLUGIN_DOWNLOAD_FILE, start,
+		       (int)ret == 0);
+
   // Check for errors
   if ((int)ret == 0)
     return(strdup(tempfile));
@@ -1205,6 +1929,8 @@ hplip_web_plugin(
   pappl_version_t     version;
   hplip_plugin_status_t plugin_status;
   char                *plugin_dir = NULL;
+  int                 ok;
+  double              start;
   char                buf[2048];
   char                *licensetext = NULL;
   FILE                *fp;
@@ -1253,7 +1979,11 @@ hplip_web_plugin(
         {
 	  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
 		   "Downloading the proprietary plugin ...");
-	  if ((plugin_dir = hplip_download_plugin(system)) == NULL)
+	  start = hplip_time();
+	  plugin_dir = hplip_download_plugin(system);
+	  hplip_metrics_plugin(HPLIP_METRIC_PLUGIN_DOWNLOAD, start,
+			       plugin_dir != NULL);
+	  if (plugin_dir == NULL)
 	    papplLog(system, PAPPL_LOGLEVEL_ERROR,
 		     "Unable to download plugin ...");
 	  else
@@ -1288,7 +2018,10 @@ hplip_web_plugin(
 	    plugin_dir = hplip_get_uncompress_dir(system, 0);
 	  if (plugin_dir)
 	  {
-	    if (hplip_install_plugin(system, plugin_dir))
+	    start = hplip_time();
+	    ok = hplip_install_plugin(system, plugin_dir);
+	    hplip_metrics_plugin(HPLIP_METRIC_PLUGIN_INSTALL, start, ok);
+	    if (ok)
 	    {
 	      // Succeeded, update plugin status and get back to plugin
 	      // status page
@@ -1327,7 +2060,10 @@ hplip_web_plugin(
 	  plugin_dir = hplip_get_uncompress_dir(system, 0);
 	if (plugin_dir)
 	{
-	  if (hplip_remove_plugin(system, plugin_dir))
+	  start = hplip_time();
+	  ok = hplip_remove_plugin(system, plugin_dir);
+	  hplip_metrics_plugin(HPLIP_METRIC_PLUGIN_REMOVE, start, ok);
+	  if (ok)
 	  {
 	    // Succeeded, update plugin status and get back to plugin
 	    // status page
@@ -1668,6 +2404,8 @@ hplip_plugin_support(void *data)
   pappl_system_t   *system = prGetSystem(global_data);
   hplip_plugin_status_t plugin_status;
   char             *plugin_dir;
+  int              ok;
+  double           start;
 
 
   // Get status of installed plugin
@@ -1688,7 +2426,11 @@ hplip_plugin_support(void *data)
     {
       papplLog(system, PAPPL_LOGLEVEL_DEBUG,
 	       "Updating an already installed proprietary plugin ...");
-      if ((plugin_dir = hplip_download_plugin(system)) == NULL)
+      start = hplip_time();
+      plugin_dir = hplip_download_plugin(system);
+      hplip_metrics_plugin(HPLIP_METRIC_PLUGIN_DOWNLOAD, start,
+			   plugin_dir != NULL);
+      if (plugin_dir == NULL)
       {
 	papplLog(system, PAPPL_LOGLEVEL_ERROR,
 		 "Unable to download plugin ...");
@@ -1698,7 +2440,10 @@ hplip_plugin_support(void *data)
 	papplLog(system, PAPPL_LOGLEVEL_DEBUG,
 		 "Plugin downloaded to %s", plugin_dir);
 
-	if (hplip_install_plugin(system, plugin_dir))
+	start = hplip_time();
+	ok = hplip_install_plugin(system, plugin_dir);
+	hplip_metrics_plugin(HPLIP_METRIC_PLUGIN_INSTALL, start, ok);
+	if (ok)
 	  papplLog(system, PAPPL_LOGLEVEL_DEBUG,
 		   "Plugin installed.");
 	else
@@ -1722,64 +2467,4510 @@ hplip_plugin_support(void *data)
 }
 
 
+
 //
-// 'hplip_printer_extra_web_if()' - Add button for plugin web
-//                                  interface page to print queue
-//                                  entries which need the plugin.
-//                                  Also call original function for
-//                                  adding the "Device Settings",
-//                                  page, needed especially for the
-//                                  PostScript printers.
+// 'hplip_state_dir()' - Return the state directory of the Printer
+//                       Application, from the STATE_DIR environment
+//                       variable or the compiled-in default
 //
 
-void
-hplip_printer_extra_web_if(pappl_printer_t *printer, // I - Printer
-			   void *data)               // I - Global data
+const char *
+hplip_state_dir(void)
 {
-  pr_printer_app_global_data_t *global_data =
-    (pr_printer_app_global_data_t *)data;
-  pappl_system_t   *system = prGetSystem(global_data);
-  pappl_pr_driver_data_t driver_data;
+  const char *dir;
 
 
-  // "Device Settings" page for PPDs with "Installable Options" group or
-  // PostScript query code for printer settings
-  prSetupDeviceSettingsPage(printer, data);
+  if ((dir = getenv("STATE_DIR")) != NULL && dir[0])
+    return (dir);
 
-  papplPrinterGetDriverData(printer, &driver_data);
-  if (strcasestr(driver_data.make_and_model, "proprietary plugin"))
+  return (STATE_DIR);
+}
+
+
+//
+// 'hplip_printer_file()' - Get the name of a per-printer file in a
+//                          sub-directory of the state directory,
+//                          creating the sub-directory if needed
+//
+
+char *
+hplip_printer_file(const char *printer_name,
+		   const char *subdir,
+		   const char *ext,
+		   char *buf,
+		   size_t bufsize)
+{
+  char name[256],
+       *ptr;
+
+
+  // Printer names can contain anything, only use the safe characters
+  snprintf(name, sizeof(name), "%s", printer_name);
+  for (ptr = name; *ptr; ptr ++)
+    if (!isalnum(*ptr & 255) && *ptr != '-')
+      *ptr = '_';
+
+  snprintf(buf, bufsize, "%s/%s", hplip_state_dir(), subdir);
+  if (mkdir(buf, S_IRWXU) == -1 && errno != EEXIST)
+    return (NULL);
+
+  snprintf(buf, bufsize, "%s/%s/%s.%s", hplip_state_dir(), subdir, name,
+	   ext);
+
+  return (buf);
+}
+
+
+//
+// 'hplip_conversion_stats_read()' - Read the measured conversion times
+//                                   from an open stats file
+//
+
+int
+hplip_conversion_stats_read(FILE *fp,
+			    hplip_conversion_stats_t *stats)
+{
+  int num_stats = 0;
+  char line[256];
+
+
+  rewind(fp);
+
+  while (num_stats < CONVERSION_STATS_MAX &&
+	 fgets(line, sizeof(line), fp))
   {
-    // Printer needs the plugin, add a "Plugin" button to get to the
-    // plugin management web interface page to the printer's entry
-    papplPrinterAddLink(printer, "Plugin", "/plugin",
-			PAPPL_LOPTIONS_NAVIGATION | PAPPL_LOPTIONS_STATUS);
+    if (sscanf(line, "%63s%63s%31s%d%lf%lf%lf",
+	       stats[num_stats].srctype, stats[num_stats].dsttype,
+	       stats[num_stats].jobclass, &stats[num_stats].runs,
+	       &stats[num_stats].seconds, &stats[num_stats].bytes,
+	       &stats[num_stats].blocked) == 7)
+      num_stats ++;
   }
+
+  return (num_stats);
 }
 
 
 //
-// 'main()' - Main entry for the hplip-printer-app.
+// 'hplip_conversion_stats_load()' - Load the measured conversion
+//                                   times of a printer
 //
 
 int
-main(int  argc,				// I - Number of command-line arguments
-     char *argv[])			// I - Command-line arguments
+hplip_conversion_stats_load(const char *printer_name,
+			    hplip_conversion_stats_t *stats)
 {
-  cups_array_t *spooling_conversions,
-               *stream_formats,
-               *driver_selection_regex_list;
+  char buf[1024];
+  FILE *fp;
+  int num_stats;
 
-  // Array of spooling conversions, most desirables first
-  //
+
+  if (!hplip_printer_file(printer_name, CONVERSION_STATS_DIR, "stats",
+			  buf, sizeof(buf)) ||
+      (fp = fopen(buf, "r")) == NULL)
+    return (0);
+
+  flock(fileno(fp), LOCK_SH);
+  num_stats = hplip_conversion_stats_read(fp, stats);
+  flock(fileno(fp), LOCK_UN);
+  fclose(fp);
+
+  return (num_stats);
+}
+
+
+//
+// 'hplip_conversion_stats_update()' - Add the measurements of a job to
+//                                     the conversion times of the
+//                                     printer
+//
+
+void
+hplip_conversion_stats_update(const char *printer_name,
+			      const pr_spooling_conversion_t *conversion,
+			      const char *jobclass,
+			      double seconds,
+			      size_t bytes,
+			      double blocked)
+{
+  char buf[1024];
+  int fd;
+  FILE *fp;
+  int i, num_stats;
+  hplip_conversion_stats_t stats[CONVERSION_STATS_MAX],
+                           *s;
+  double weight;
+
+
+  if (!hplip_printer_file(printer_name, CONVERSION_STATS_DIR, "stats",
+			  buf, sizeof(buf)) ||
+      (fd = open(buf, O_RDWR | O_CREAT, 0600)) < 0)
+    return;
+
+  if ((fp = fdopen(fd, "r+")) == NULL)
+  {
+    close(fd);
+    return;
+  }
+
+  // Jobs of a printer can get filtered in several processes, so lock
+  // the file during the whole read-modify-write cycle
+  flock(fd, LOCK_EX);
+
+  num_stats = hplip_conversion_stats_read(fp, stats);
+
+  for (i = 0, s = stats; i < num_stats; i ++, s ++)
+    if (!strcmp(s->srctype, conversion->srctype) &&
+	!strcmp(s->dsttype, conversion->dsttype) &&
+	!strcmp(s->jobclass, jobclass))
+      break;
+
+  if (i == num_stats)
+  {
+    // New entry, if the table is full, replace the one with the least jobs
+    if (num_stats == CONVERSION_STATS_MAX)
+    {
+      for (i = 1, s = stats; i < num_stats; i ++)
+	if (stats[i].runs < s->runs)
+	  s = stats + i;
+    }
+    else
+      num_stats ++;
+    memset(s, 0, sizeof(hplip_conversion_stats_t));
+    snprintf(s->srctype, sizeof(s->srctype), "%s", conversion->srctype);
+    snprintf(s->dsttype, sizeof(s->dsttype), "%s", conversion->dsttype);
+    snprintf(s->jobclass, sizeof(s->jobclass), "%s", jobclass);
+  }
+
+  // Moving average, so that the costs follow changes of the printer
+  // (firmware update, network, ...)
+  weight = s->runs ? CONVERSION_STATS_WEIGHT : 1.0;
+  s->seconds = (1.0 - weight) * s->seconds + weight * seconds;
+  s->bytes   = (1.0 - weight) * s->bytes + weight * (double)bytes;
+  s->blocked = (1.0 - weight) * s->blocked + weight * blocked;
+  s->runs ++;
+
+  rewind(fp);
+  if (ftruncate(fd, 0) == 0)
+  {
+    for (i = 0, s = stats; i < num_stats; i ++, s ++)
+      fprintf(fp, "%s %s %s %d %.6f %.0f %.6f\n", s->srctype, s->dsttype,
+	      s->jobclass, s->runs, s->seconds, s->bytes, s->blocked);
+    fflush(fp);
+  }
+
+  flock(fd, LOCK_UN);
+  fclose(fp);
+}
+
+
+//
+// 'hplip_conversion_recent_load()' - Load the recent jobs of a printer,
+//                                    oldest first
+//
+
+int
+hplip_conversion_recent_load(const char *printer_name,
+			     hplip_conversion_recent_t *recent)
+{
+  char buf[1024];
+  FILE *fp;
+  int num_recent = 0;
+
+
+  if (!hplip_printer_file(printer_name, CONVERSION_STATS_DIR, "jobs",
+			  buf, sizeof(buf)) ||
+      (fp = fopen(buf, "r")) == NULL)
+    return (0);
+
+  flock(fileno(fp), LOCK_SH);
+  while (num_recent < CONVERSION_RECENT_JOBS && fgets(buf, sizeof(buf), fp))
+  {
+    if (sscanf(buf, "%d%31s%lf%lf%d", &recent[num_recent].job_id,
+	       recent[num_recent].jobclass, &recent[num_recent].waited,
+	       &recent[num_recent].seconds,
+	       &recent[num_recent].status) == 5)
+      num_recent ++;
+  }
+  flock(fileno(fp), LOCK_UN);
+  fclose(fp);
+
+  return (num_recent);
+}
+
+
+//
+// 'hplip_conversion_recent_add()' - Add a job to the recent jobs of a
+//                                   printer, with the time it waited
+//                                   for the scheduler
+//
+
+void
+hplip_conversion_recent_add(const char *printer_name,
+			    int job_id,
+			    const char *jobclass,
+			    double waited,
+			    double seconds,
+			    int status)
+{
+  char buf[1024];
+  int fd;
+  FILE *fp;
+  int i, num_recent;
+  hplip_conversion_recent_t recent[CONVERSION_RECENT_JOBS];
+
+
+  if (!hplip_printer_file(printer_name, CONVERSION_STATS_DIR, "jobs",
+			  buf, sizeof(buf)) ||
+      (fd = open(buf, O_RDWR | O_CREAT, 0600)) < 0)
+    return;
+
+  if ((fp = fdopen(fd, "r+")) == NULL)
+  {
+    close(fd);
+    return;
+  }
+
+  flock(fd, LOCK_EX);
+
+  for (num_recent = 0; num_recent < CONVERSION_RECENT_JOBS &&
+			 fgets(buf, sizeof(buf), fp);)
+  {
+    if (sscanf(buf, "%d%31s%lf%lf%d", &recent[num_recent].job_id,
+	       recent[num_recent].jobclass, &recent[num_recent].waited,
+	       &recent[num_recent].seconds,
+	       &recent[num_recent].status) == 5)
+      num_recent ++;
+  }
+
+  // Drop the oldest job when the list is full
+  i = num_recent == CONVERSION_RECENT_JOBS ? 1 : 0;
+
+  rewind(fp);
+  if (ftruncate(fd, 0) == 0)
+  {
+    for (; i < num_recent; i ++)
+      fprintf(fp, "%d %s %.6f %.6f %d\n", recent[i].job_id,
+	      recent[i].jobclass, recent[i].waited, recent[i].seconds,
+	      recent[i].status);
+    fprintf(fp, "%d %s %.6f %.6f %d\n", job_id, jobclass, waited, seconds,
+	    status);
+    fflush(fp);
+  }
+
+  flock(fd, LOCK_UN);
+  fclose(fp);
+}
+
+
+//
+// 'hplip_conversion_jobs()' - Number of conversions which can run at a
+//                             time, by default one per CPU core, can be
+//                             changed with the CONVERSION_JOBS
+//                             environment variable
+//
+
+int
+hplip_conversion_jobs(void)
+{
+  const char *val;
+  int jobs;
+
+
+  if ((val = getenv("CONVERSION_JOBS")) != NULL && atoi(val) > 0)
+    return (atoi(val));
+  else if ((jobs = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    return (1);
+
+  return (jobs);
+}
+
+
+//
+// 'hplip_job_class()' - Classify a job by color mode and size, jobs of
+//                       the same class have similar conversion times
+//
+
+void
+hplip_job_class(int inputfd,
+		cf_filter_data_t *data,
+		char *buf,
+		size_t bufsize)
+{
+  const char *val;
+  struct stat st;
+  int color = 1;
+  const char *size = "unknown";
+
+
+  if ((val = cupsGetOption("print-color-mode", data->num_options,
+			   data->options)) != NULL)
+    color = strcasecmp(val, "monochrome") && strcasecmp(val, "bi-level") &&
+            strcasecmp(val, "process-monochrome");
+  else if ((val = cupsGetOption("ColorModel", data->num_options,
+				data->options)) != NULL)
+    color = !strcasestr(val, "gray") && strcasecmp(val, "KGray") &&
+            strcasecmp(val, "Mono");
+
+  // The size of the spooled input is the cheapest proxy for page count
+  // and image content we have before the conversion
+  if (fstat(inputfd, &st) == 0 && S_ISREG(st.st_mode))
+  {
+    if (st.st_size < 256 * 1024)
+      size = "small";
+    else if (st.st_size < 8 * 1024 * 1024)
+      size = "medium";
+    else
+      size = "large";
+  }
+
+  snprintf(buf, bufsize, "%s-%s", color ? "color" : "mono", size);
+}
+
+
+//
+// 'hplip_compare_ints()' - Compare two integers for qsort()
+//
+
+int
+hplip_compare_ints(const void *a,
+		   const void *b)
+{
+  return (*(const int *)a - *(const int *)b);
+}
+
+
+//
+// 'hplip_trace_jobs()' - Number of job traces to keep per printer, 0
+//                        if jobs are not traced
+//
+
+int
+hplip_trace_jobs(void)
+{
+  static int jobs = -1;
+  const char *val;
+
+
+  if (jobs < 0)
+    jobs = ((val = getenv("TRACE_JOBS")) != NULL ? atoi(val) : TRACE_JOBS);
+
+  return (jobs > 0 ? jobs : 0);
+}
+
+
+//
+// 'hplip_trace_file()' - Get the name of a file of a job's trace
+//
+
+char *
+hplip_trace_file(const char *printer_name,
+		 int job_id,
+		 const char *ext,
+		 char *buf,
+		 size_t bufsize)
+{
+  char jobext[64];
+
+
+  snprintf(jobext, sizeof(jobext), "%d.%s", job_id, ext);
+
+  return (hplip_printer_file(printer_name, TRACE_DIR, jobext, buf,
+			     bufsize));
+}
+
+
+//
+// 'hplip_trace_event()' - Record a span (or, with a negative end, an
+//                         instant) of a job in Chrome's trace event
+//                         format. Filter processes append to the same
+//                         events file, each with one write() per event
+//
+
+void
+hplip_trace_event(cf_filter_data_t *data,
+		  const char *name,
+		  const char *cat,
+		  double start,
+		  double end,
+		  const char *args)
+{
+  char file[1024],
+       line[1024];
+  int fd, len;
+
+
+  if (!hplip_trace_jobs() || !data->printer ||
+      !hplip_trace_file(data->printer, data->job_id, "events", file,
+			sizeof(file)))
+    return;
+
+  if (end < 0.0)
+    len = snprintf(line, sizeof(line),
+		   "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%.0f,\"pid\":%d,\"tid\":%d,\"args\":{%s}}\n",
+		   name, cat, start * 1000000.0, data->job_id, (int)getpid(),
+		   args ? args : "");
+  else
+    len = snprintf(line, sizeof(line),
+		   "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%d,\"args\":{%s}}\n",
+		   name, cat, start * 1000000.0, (end - start) * 1000000.0,
+		   data->job_id, (int)getpid(), args ? args : "");
+  if (len <= 0 || len >= (int)sizeof(line))
+    return;
+
+  if ((fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0600)) >= 0)
+  {
+    if (write(fd, line, (size_t)len) != len && data->logfunc)
+      data->logfunc(data->logdata, CF_LOGLEVEL_DEBUG,
+		    "hplip_trace_event: Unable to write %s: %s", file,
+		    strerror(errno));
+    close(fd);
+  }
+}
+
+
+//
+// 'hplip_trace_filter()' - Filter wrapper recording the time of a
+//                          filter of the conversion, used instead of
+//                          the filter itself when jobs are traced
+//
+
+int
+hplip_trace_filter(int inputfd,
+		   int outputfd,
+		   int inputseekable,
+		   cf_filter_data_t *data,
+		   void *parameters)
+{
+  cf_filter_filter_in_chain_t *filter =
+    (cf_filter_filter_in_chain_t *)parameters;
+  char args[64];
+  double start = hplip_time();
+  int status;
+
+
+  status = (filter->function)(inputfd, outputfd, inputseekable, data,
+			      filter->parameters);
+
+  snprintf(args, sizeof(args), "\"status\":%d", status);
+  hplip_trace_event(data, filter->name ? filter->name : "filter", "filter",
+		    start, hplip_time(), args);
+
+  return (status);
+}
+
+
+//
+// 'hplip_trace_finish()' - Write the trace of a job as Chrome trace
+//                          event JSON file, append its events to the
+//                          rolling trace file, and remove the oldest
+//                          traces of the printer
+//
+
+void
+hplip_trace_finish(cf_filter_data_t *data)
+{
+  char file[1024],
+       jsonfile[1024],
+       tracefile[1024],
+       line[1024],
+       prefix[256],
+       *ptr;
+  FILE *in,
+       *out,
+       *trace = NULL;
+  struct stat st;
+  DIR *dir;
+  struct dirent *entry;
+  off_t limit;
+  const char *val;
+  int i, num_events = 0,
+      *jobs = NULL,
+      num_jobs = 0,
+      alloc_jobs = 0;
+
+
+  if (!hplip_trace_jobs() || !data->printer ||
+      !hplip_trace_file(data->printer, data->job_id, "events", file,
+			sizeof(file)) ||
+      !hplip_trace_file(data->printer, data->job_id, "json", jsonfile,
+			sizeof(jsonfile)) ||
+      (in = fopen(file, "r")) == NULL)
+    return;
+
+  if ((out = fopen(jsonfile, "w")) == NULL)
+  {
+    fclose(in);
+    unlink(file);
+    return;
+  }
+
+  // Rolling file with the events of all jobs, in the JSON array format
+  // which Chrome's trace viewer accepts without the closing bracket
+  snprintf(tracefile, sizeof(tracefile), "%s/%s/%s", hplip_state_dir(),
+	   TRACE_DIR, TRACE_FILE);
+  if ((val = getenv("TRACE_FILE_SIZE")) != NULL)
+    limit = (off_t)atol(val) * 1024 * 1024;
+  else
+    limit = (off_t)TRACE_FILE_SIZE * 1024 * 1024;
+  if (limit > 0 && (trace = fopen(tracefile, "a")) != NULL)
+  {
+    flock(fileno(trace), LOCK_EX);
+    if (!fstat(fileno(trace), &st) && st.st_size > limit)
+    {
+      snprintf(line, sizeof(line), "%s.1", tracefile);
+      rename(tracefile, line);
+      fclose(trace);
+      if ((trace = fopen(tracefile, "a")) != NULL)
+	flock(fileno(trace), LOCK_EX);
+    }
+    if (trace && !ftell(trace))
+      fputs("[\n", trace);
+  }
+
+  fputs("{\"traceEvents\":[\n", out);
+  hplip_metrics_escape(data->printer, prefix, sizeof(prefix));
+  fprintf(out,
+	  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"Job %d on %s\"}}",
+	  data->job_id, data->job_id, prefix);
+  if (trace)
+    fprintf(trace,
+	    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"Job %d on %s\"}},\n",
+	    data->job_id, data->job_id, prefix);
+  while (fgets(line, sizeof(line), in))
+  {
+    if ((ptr = strchr(line, '\n')) != NULL)
+      *ptr = '\0';
+    if (!line[0])
+      continue;
+    fprintf(out, ",\n%s", line);
+    if (trace)
+      fprintf(trace, "%s,\n", line);
+    num_events ++;
+  }
+  fputs("\n],\"displayTimeUnit\":\"ms\"}\n", out);
+
+  fclose(in);
+  fclose(out);
+  unlink(file);
+  if (trace)
+    fclose(trace);
+  if (!num_events)
+  {
+    unlink(jsonfile);
+    return;
+  }
+
+  // Keep only the traces of the most recent jobs of the printer
+  if ((ptr = strrchr(jsonfile, '/')) == NULL)
+    return;
+  *ptr++ = '\0';
+  snprintf(prefix, sizeof(prefix), "%.*s.", (int)strcspn(ptr, "."), ptr);
+  if ((dir = opendir(jsonfile)) == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (strncmp(entry->d_name, prefix, strlen(prefix)) ||
+	(ptr = strstr(entry->d_name, ".json")) == NULL || ptr[5])
+      continue;
+    if (num_jobs >= alloc_jobs)
+    {
+      int *temp = (int *)realloc(jobs, (size_t)(alloc_jobs + 64) *
+				 sizeof(int));
+      if (!temp)
+	break;
+      jobs = temp;
+      alloc_jobs += 64;
+    }
+    jobs[num_jobs ++] = atoi(entry->d_name + strlen(prefix));
+  }
+  closedir(dir);
+
+  // Job IDs increase, so the lowest ones are the oldest
+  if (num_jobs > hplip_trace_jobs())
+  {
+    qsort(jobs, (size_t)num_jobs, sizeof(int), hplip_compare_ints);
+    for (i = 0; i < num_jobs - hplip_trace_jobs(); i ++)
+      if (hplip_trace_file(data->printer, jobs[i], "json", file,
+			   sizeof(file)))
+	unlink(file);
+  }
+  free(jobs);
+}
+
+
+//
+// 'hplip_job_event()' - Event callback of the system: Note when jobs
+//                       get created and start processing, and on their
+//                       completion count their duration and end their
+//                       trace, after the backend has finished
+//
+
+void
+hplip_job_event(pappl_system_t *system,
+		pappl_printer_t *printer,
+		pappl_job_t *job,
+		pappl_event_t event,
+		void *event_data)
+{
+  static hplip_job_times_t times[JOB_TIMES];
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  hplip_job_times_t *t,
+		    done;
+  cf_filter_data_t data;
+  double now = hplip_time();
+  char args[64];
+  int job_id;
+
+
+  (void)system;
+  (void)event_data;
+
+  if (!printer || !job || (job_id = papplJobGetID(job)) <= 0)
+    return;
+
+  // Job IDs are unique in the system, so the entry of a job is its ID
+  // modulo the table size, the job's own times come with the same ID
+  pthread_mutex_lock(&mutex);
+  t = &times[job_id % JOB_TIMES];
+  if (event & PAPPL_EVENT_JOB_CREATED)
+  {
+    t->job_id     = job_id;
+    t->created    = now;
+    t->processing = 0.0;
+  }
+  if ((event & PAPPL_EVENT_JOB_STATE_CHANGED) && t->job_id == job_id &&
+      t->processing == 0.0 &&
+      papplJobGetState(job) == IPP_JSTATE_PROCESSING)
+    t->processing = now;
+  if (!(event & PAPPL_EVENT_JOB_COMPLETED))
+  {
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  if (t->job_id == job_id)
+  {
+    done      = *t;
+    t->job_id = 0;
+  }
+  else
+  {
+    // Created before we got its events, from PAPPL's times in seconds
+    done.job_id     = job_id;
+    done.created    = now - (double)(time(NULL) -
+				     papplJobGetTimeCreated(job));
+    done.processing = papplJobGetTimeProcessed(job) ?
+                      now - (double)(time(NULL) -
+				     papplJobGetTimeProcessed(job)) : 0.0;
+  }
+  pthread_mutex_unlock(&mutex);
+
+  // The same duration for the metrics and the job's trace
+  if (papplJobGetState(job) == IPP_JSTATE_COMPLETED)
+    hplip_metrics_job_duration(papplPrinterGetName(printer),
+			       now - done.created);
+
+  if (!hplip_trace_jobs())
+    return;
+
+  memset(&data, 0, sizeof(data));
+  data.printer = (char *)papplPrinterGetName(printer);
+  data.job_id  = job_id;
+  if (done.processing > 0.0)
+    hplip_trace_event(&data, "received and queued", "spool", done.created,
+		      done.processing, NULL);
+  snprintf(args, sizeof(args), "\"state\":%d", (int)papplJobGetState(job));
+  hplip_trace_event(&data, "job", "job", done.created, now, args);
+  hplip_trace_finish(&data);
+}
+
+
+//
+// 'hplip_conversion_run()' - Thread running the filters of a wrapped
+//                            conversion
+//
+
+void *
+hplip_conversion_run(void *arg)
+{
+  hplip_conversion_job_t *job = (hplip_conversion_job_t *)arg;
+
+
+  // cfFilterChain() closes inputfd and outputfd when done
+  job->status = cfFilterChain(job->inputfd, job->outputfd,
+			      job->inputseekable, job->data,
+			      job->traced ? job->conversion->traced_filters :
+			      job->conversion->filters);
+
+  return (NULL);
+}
+
+
+//
+// 'hplip_spool_dir()' - Return the spool directory of the Printer
+//                       Application, from the SPOOL_DIR environment
+//                       variable or the compiled-in default
+//
+
+const char *
+hplip_spool_dir(void)
+{
+  const char *dir;
+
+
+  if ((dir = getenv("SPOOL_DIR")) != NULL && dir[0])
+    return (dir);
+
+  return (SPOOL_DIR);
+}
+
+
+//
+// 'hplip_render_cache_size()' - Size limit of the render cache in bytes,
+//                               0 if only the test page gets cached
+//
+
+off_t
+hplip_render_cache_size(void)
+{
+  const char *val;
+
+
+  if ((val = getenv("RENDER_CACHE_SIZE")) != NULL && val[0])
+    return ((off_t)atol(val) * 1024 * 1024);
+
+  return ((off_t)RENDER_CACHE_SIZE * 1024 * 1024);
+}
+
+
+//
+// 'hplip_render_cache_copies()' - Number of times the cached output of
+//                                 a job can be sent to produce its
+//                                 copies, 0 if the copies must be
+//                                 produced by the conversion itself
+//
+
+int
+hplip_render_cache_copies(cf_filter_data_t *data,
+			  const pr_spooling_conversion_t *conversion)
+{
+  const char *val;
+
+
+  if (data->copies <= 1)
+    return (1);
+
+  // Repeating the output gives collated copies, and only CUPS Raster
+  // can simply be concatenated
+  if (strcmp(conversion->dsttype, "application/vnd.cups-raster"))
+    return (0);
+  if ((val = cupsGetOption("multiple-document-handling", data->num_options,
+			   data->options)) != NULL)
+    return (strstr(val, "uncollated") ? 0 : data->copies);
+  if ((val = cupsGetOption("Collate", data->num_options,
+			   data->options)) != NULL)
+    return (strcasecmp(val, "true") ? 0 : data->copies);
+
+  return (0);
+}
+
+
+//
+// 'hplip_compare_strings()' - Compare two strings for qsort()
+//
+
+int
+hplip_compare_strings(const void *a,
+		      const void *b)
+{
+  return (strcmp(*(const char **)a, *(const char **)b));
+}
+
+
+//
+// 'hplip_testpage_file()' - Find the test page, the one of the Snap
+//                           (PDF) or the one installed by "make install"
+//                           (PostScript)
+//
+
+char *
+hplip_testpage_file(char *buf,
+		    size_t bufsize)
+{
+  const char *dir;
+  char snapdir[1024];
+
+
+  if ((dir = getenv("TESTPAGE_DIR")) == NULL || !dir[0])
+  {
+    if ((dir = getenv("SNAP")) != NULL && dir[0])
+    {
+      snprintf(snapdir, sizeof(snapdir), "%s%s", dir, TESTPAGE_DIR);
+      dir = snapdir;
+    }
+    else
+      dir = TESTPAGE_DIR;
+  }
+
+  snprintf(buf, bufsize, "%s/%s", dir, TESTPAGE);
+  if (!access(buf, R_OK))
+    return (buf);
+
+  snprintf(buf, bufsize, "%s/%s", dir, TESTPAGE_ALT);
+  if (!access(buf, R_OK))
+    return (buf);
+
+  return (NULL);
+}
+
+
+//
+// 'hplip_testpage_hash()' - Hash of the test page's content, to
+//                           recognize test page jobs
+//
+
+int
+hplip_testpage_hash(unsigned char *hash)
+{
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static unsigned char testpage_hash[SHA256_DIGEST_LENGTH];
+  static int state = 0;			// 0: Not read, 1: OK, -1: Error
+  SHA256_CTX ctx;
+  char filename[1024],
+       buf[65536];
+  ssize_t bytes;
+  int fd;
+
+
+  pthread_mutex_lock(&mutex);
+  if (state == 0)
+  {
+    state = -1;
+    if (hplip_testpage_file(filename, sizeof(filename)) &&
+	(fd = open(filename, O_RDONLY)) >= 0)
+    {
+      SHA256_Init(&ctx);
+      while ((bytes = read(fd, buf, sizeof(buf))) > 0)
+	SHA256_Update(&ctx, buf, bytes);
+      close(fd);
+      if (bytes == 0)
+      {
+	SHA256_Final(testpage_hash, &ctx);
+	state = 1;
+      }
+    }
+  }
+  if (state == 1)
+    memcpy(hash, testpage_hash, SHA256_DIGEST_LENGTH);
+  pthread_mutex_unlock(&mutex);
+
+  return (state == 1);
+}
+
+
+//
+// 'hplip_testpage_size()' - Check whether a job's input has the size of
+//                           the test page, to avoid hashing all jobs
+//                           when only the test page gets cached
+//
+
+int
+hplip_testpage_size(int inputfd)
+{
+  char filename[1024];
+  struct stat st,
+              testpage_st;
+
+
+  return (!fstat(inputfd, &st) && S_ISREG(st.st_mode) &&
+	  hplip_testpage_file(filename, sizeof(filename)) &&
+	  !stat(filename, &testpage_st) &&
+	  st.st_size == testpage_st.st_size);
+}
+
+
+//
+// 'hplip_testpage()' - Test page print callback, supplying the test
+//                      page file. Its conversion output gets cached
+//                      for each printer model, resolution, and color
+//                      mode, so only the first test print on each of
+//                      them gets rendered
+//
+
+const char *
+hplip_testpage(pappl_printer_t *printer,
+	       char *buffer,
+	       size_t bufsize)
+{
+  if (hplip_testpage_file(buffer, bufsize))
+    return (buffer);
+
+  papplLogPrinter(printer, PAPPL_LOGLEVEL_ERROR,
+		  "Test page %s or %s not found", TESTPAGE, TESTPAGE_ALT);
+  return (NULL);
+}
+
+
+//
+// 'hplip_render_cache_key()' - Compute the cache key for a job: A hash
+//                              of the document, the conversion, the
+//                              options, and the printer's PPD file.
+//                              Non-seekable input gets copied into a
+//                              temporary file, replacing inputfd. Keys
+//                              for the test page get a special prefix.
+//
+
+int
+hplip_render_cache_key(int *inputfd,
+		       int *inputseekable,
+		       cf_filter_data_t *data,
+		       const pr_spooling_conversion_t *conversion,
+		       char *key,
+		       size_t keysize)
+{
+  SHA256_CTX ctx,
+             doc_ctx;
+  unsigned char hash[SHA256_DIGEST_LENGTH],
+                doc_hash[SHA256_DIGEST_LENGTH],
+                testpage_hash[SHA256_DIGEST_LENGTH];
+  char buf[65536],
+       tempfile[1024],
+       *ptr;
+  const char **options;
+  ssize_t bytes;
+  int i, num_options, fd, tempfd = -1;
+  ppd_filter_data_ext_t *ppd_ext;
+  static const char * const ignore[] =	// Options not changing the output
+  {
+    "Collate",
+    "copies",
+    "document-name",
+    "job-hold-until",
+    "job-id",
+    "job-name",
+    "job-originating-user-name",
+    "job-priority",
+    "job-uuid",
+    "multiple-document-handling"
+  };
+
+
+  if (keysize < sizeof(RENDER_CACHE_TESTPAGE) + 2 * SHA256_DIGEST_LENGTH)
+    return (0);
+
+  SHA256_Init(&ctx);
+  SHA256_Init(&doc_ctx);
+
+  // Conversion
+  SHA256_Update(&ctx, conversion->srctype, strlen(conversion->srctype) + 1);
+  SHA256_Update(&ctx, conversion->dsttype, strlen(conversion->dsttype) + 1);
+
+  // Options, sorted, as their order does not matter
+  if ((options = (const char **)calloc(data->num_options + 1,
+					sizeof(char *))) == NULL)
+    return (0);
+  for (i = 0, num_options = 0; i < data->num_options; i ++)
+  {
+    size_t j;
+
+    for (j = 0; j < sizeof(ignore) / sizeof(ignore[0]); j ++)
+      if (!strcasecmp(data->options[i].name, ignore[j]))
+	break;
+    if (j == sizeof(ignore) / sizeof(ignore[0]))
+      options[num_options ++] = data->options[i].name;
+  }
+  qsort(options, num_options, sizeof(char *), hplip_compare_strings);
+  for (i = 0; i < num_options; i ++)
+  {
+    const char *value = cupsGetOption(options[i], data->num_options,
+				      data->options);
+    SHA256_Update(&ctx, options[i], strlen(options[i]) + 1);
+    SHA256_Update(&ctx, value, strlen(value) + 1);
+  }
+  free(options);
+
+  // PPD file, printers of the same model share cache entries. Without
+  // PPD the entries are per printer
+  if ((ppd_ext = (ppd_filter_data_ext_t *)
+       cfFilterDataGetExt(data, PPD_FILTER_DATA_EXT)) != NULL &&
+      ppd_ext->ppdfile && (fd = open(ppd_ext->ppdfile, O_RDONLY)) >= 0)
+  {
+    while ((bytes = read(fd, buf, sizeof(buf))) > 0)
+      SHA256_Update(&ctx, buf, bytes);
+    close(fd);
+  }
+  else if (data->printer)
+    SHA256_Update(&ctx, data->printer, strlen(data->printer) + 1);
+
+  // Document
+  if (!*inputseekable || lseek(*inputfd, 0, SEEK_SET) != 0)
+  {
+    if ((tempfd = cupsTempFd(tempfile, sizeof(tempfile))) < 0)
+      return (0);
+    unlink(tempfile);
+  }
+  while ((bytes = read(*inputfd, buf, sizeof(buf))) > 0)
+  {
+    SHA256_Update(&doc_ctx, buf, bytes);
+    if (tempfd >= 0 && write(tempfd, buf, bytes) != bytes)
+      bytes = -1;
+  }
+  if (tempfd >= 0)
+  {
+    // The input is consumed, continue with the copy
+    close(*inputfd);
+    *inputfd = tempfd;
+    *inputseekable = 1;
+  }
+  if (bytes < 0 || lseek(*inputfd, 0, SEEK_SET) != 0)
+    return (0);
+
+  SHA256_Final(doc_hash, &doc_ctx);
+  SHA256_Update(&ctx, doc_hash, sizeof(doc_hash));
+  SHA256_Final(hash, &ctx);
+
+  // The test page gets printed on each new queue, keep its entries
+  if (hplip_testpage_hash(testpage_hash) &&
+      !memcmp(doc_hash, testpage_hash, sizeof(doc_hash)))
+    ptr = key + snprintf(key, keysize, "%s", RENDER_CACHE_TESTPAGE);
+  else
+    ptr = key;
+  for (i = 0; i < SHA256_DIGEST_LENGTH; i ++)
+    snprintf(ptr + 2 * i, 3, "%.2x", hash[i]);
+
+  return (1);
+}
+
+
+//
+// 'hplip_render_cache_file()' - Get the name of a file in the render
+//                               cache, creating the cache directory
+//                               if needed
+//
+
+char *
+hplip_render_cache_file(const char *name,
+			char *buf,
+			size_t bufsize)
+{
+  snprintf(buf, bufsize, "%s/%s", hplip_spool_dir(), RENDER_CACHE_DIR);
+  if (mkdir(buf, S_IRWXU) == -1 && errno != EEXIST)
+    return (NULL);
+
+  snprintf(buf, bufsize, "%s/%s/%s", hplip_spool_dir(), RENDER_CACHE_DIR,
+	   name);
+
+  return (buf);
+}
+
+
+//
+// 'hplip_copy_fd()' - Copy a part of a file to a pipe or socket, inside
+//                     the kernel (sendfile()) if possible, otherwise
+//                     through a buffer. The number of bytes which had to
+//                     get copied through the buffer is added to "copied"
+//
+
+int
+hplip_copy_fd(int infd,
+	      int outfd,
+	      off_t offset,
+	      size_t *total,
+	      size_t *copied)
+{
+  char buf[65536];
+  ssize_t bytes, written, ret;
+  int zerocopy = 1;
+
+
+  for (;;)
+  {
+    if (zerocopy)
+    {
+      if ((bytes = sendfile(outfd, infd, &offset, 1024 * 1024)) > 0)
+      {
+	*total += bytes;
+	continue;
+      }
+      else if (bytes == 0)
+	return (0);
+      else if (errno == EINTR || errno == EAGAIN)
+	continue;
+      else if (errno != EINVAL && errno != ENOSYS)
+	return (1);
+
+      // Not supported for these files
+      zerocopy = 0;
+    }
+
+    if ((bytes = pread(infd, buf, sizeof(buf), offset)) <= 0)
+      return (bytes < 0);
+    offset += bytes;
+
+    for (written = 0; written < bytes; written += ret)
+      if ((ret = write(outfd, buf + written, bytes - written)) < 0)
+      {
+	if (errno == EINTR || errno == EAGAIN)
+	  ret = 0;
+	else
+	  return (1);
+      }
+    *total  += bytes;
+    *copied += bytes;
+  }
+}
+
+
+//
+// 'hplip_render_cache_replay()' - Send the cached output of a job to the
+//                                 driver, copies "first" to "copies" - 1,
+//                                 CUPS Raster only once with its
+//                                 synchronization word
+//
+
+int
+hplip_render_cache_replay(int cachefd,
+			  int outputfd,
+			  int first,
+			  int copies,
+			  size_t *total,
+			  size_t *copied)
+{
+  char buf[4];
+  off_t start = 0;
+  int copy,
+      status = 0;
+  size_t prev_total = *total,
+         prev_copied = *copied;
+  hplip_metrics_shard_t *shard;
+
+
+  if (copies > 1)
+  {
+    if (pread(cachefd, buf, 4, 0) != 4)
+      return (1);
+    if (!strncmp(buf, "RaS", 3) || !strncmp(buf + 1, "SaR", 3))
+      start = 4;
+  }
+
+  for (copy = first; copy < copies && !status; copy ++)
+    status = hplip_copy_fd(cachefd, outputfd, copy == 0 ? 0 : start, total,
+			   copied);
+
+  // Count how much sendfile() saved
+  if ((shard = hplip_metrics_shard()) != NULL)
+  {
+    hplip_metrics_add(&shard->counters[HPLIP_METRIC_CACHE_BYTES],
+		      *total - prev_total);
+    hplip_metrics_add(&shard->counters[HPLIP_METRIC_CACHE_COPIED],
+		      *copied - prev_copied);
+  }
+
+  return (status);
+}
+
+
+//
+// 'hplip_render_cache_evict()' - Remove the least recently used entries
+//                                from the render cache until it fits
+//                                into its size limit, and remove the
+//                                temporary files of filters which got
+//                                killed while writing an entry
+//
+
+int
+hplip_compare_cache_entries(const void *a,
+			    const void *b)
+{
+  const hplip_cache_entry_t *ea = (const hplip_cache_entry_t *)a,
+                            *eb = (const hplip_cache_entry_t *)b;
+
+  return (ea->used < eb->used ? -1 : ea->used > eb->used ? 1 : 0);
+}
+
+void
+hplip_render_cache_evict(off_t limit)
+{
+  char dir[1024],
+       buf[1024],
+       *ptr;
+  DIR *d;
+  struct dirent *entry;
+  struct stat st;
+  hplip_cache_entry_t *entries = NULL,
+                      *temp;
+  int i, num_entries = 0, alloc_entries = 0;
+  pid_t pid;
+  off_t total = 0;
+
+
+  if (!hplip_render_cache_file("", dir, sizeof(dir)) ||
+      (d = opendir(dir)) == NULL)
+    return;
+
+  while ((entry = readdir(d)) != NULL)
+  {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+    snprintf(buf, sizeof(buf), "%s%s", dir, entry->d_name);
+    if (stat(buf, &st) || !S_ISREG(st.st_mode))
+      continue;
+
+    if (entry->d_name[0] == '.')
+    {
+      // Temporary file ".<Key>.<PID>" of a filter writing an entry, keep
+      // it only while the filter is running
+      pid = ((ptr = strrchr(entry->d_name, '.')) != entry->d_name ?
+	     (pid_t)atoi(ptr + 1) : 0);
+      if (pid <= 0 || (kill(pid, 0) && errno == ESRCH) ||
+	  time(NULL) - st.st_mtime > RENDER_CACHE_TEMP_AGE)
+	unlink(buf);
+      else
+	total += st.st_size;
+      continue;
+    }
+
+    if (!strncmp(entry->d_name, RENDER_CACHE_TESTPAGE,
+		 strlen(RENDER_CACHE_TESTPAGE)) ||
+	strlen(entry->d_name) >= sizeof(entries[0].name))
+      continue;
+    if (num_entries >= alloc_entries)
+    {
+      if ((temp = (hplip_cache_entry_t *)
+	   realloc(entries, (alloc_entries + 256) *
+		   sizeof(hplip_cache_entry_t))) == NULL)
+	break;
+      entries = temp;
+      alloc_entries += 256;
+    }
+    snprintf(entries[num_entries].name, sizeof(entries[0].name), "%s",
+	     entry->d_name);
+    entries[num_entries].size = st.st_size;
+    entries[num_entries].used = st.st_mtime;
+    num_entries ++;
+    total += st.st_size;
+  }
+  closedir(d);
+
+  if (limit > 0 && total > limit)
+  {
+    qsort(entries, num_entries, sizeof(hplip_cache_entry_t),
+	  hplip_compare_cache_entries);
+    for (i = 0; i < num_entries && total > limit; i ++)
+    {
+      snprintf(buf, sizeof(buf), "%s%s", dir, entries[i].name);
+      if (!unlink(buf))
+	total -= entries[i].size;
+    }
+  }
+
+  free(entries);
+}
+
+
+//
+// 'hplip_scheduler()' - Get the conversion scheduler, create it on the
+//                       first call. This has to happen in the main
+//                       process, before any filter gets forked, so
+//                       that the scheduler is shared by all jobs.
+//
+
+hplip_scheduler_t *
+hplip_scheduler(void)
+{
+  static hplip_scheduler_t *scheduler = NULL;
+  pthread_condattr_t condattr;
+
+
+  if (scheduler)
+    return (scheduler);
+
+  if ((scheduler = (hplip_scheduler_t *)
+       mmap(NULL, sizeof(hplip_scheduler_t), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+  {
+    scheduler = NULL;
+    return (NULL);
+  }
+  memset(scheduler, 0, sizeof(hplip_scheduler_t));
+
+  hplip_mutex_init(&scheduler->mutex);
+
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setpshared(&condattr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&scheduler->cond, &condattr);
+  pthread_condattr_destroy(&condattr);
+
+  // CPU budget
+  scheduler->max_running = hplip_conversion_jobs();
+
+  return (scheduler);
+}
+
+
+//
+// 'hplip_scheduler_enter()' - Wait until a conversion can be started.
+//                             Waiting conversions start with the lowest
+//                             expected cost first, reduced by the time
+//                             they are already waiting, so that large
+//                             jobs do not starve. Returns the entry in
+//                             the scheduler, -1 if the conversion runs
+//                             unscheduled, -2 if the job got canceled.
+//
+
+int
+hplip_scheduler_enter(double cost,
+		      cf_filter_data_t *data,
+		      double *waited)
+{
+  hplip_scheduler_t *scheduler;
+  hplip_sched_entry_t *e;
+  struct timespec timeout;
+  int i, slot, best, running;
+  double now, prio, best_prio;
+  pid_t pid = getpid();
+
+
+  *waited = 0.0;
+
+  if ((scheduler = hplip_scheduler()) == NULL)
+    return (-1);
+
+  hplip_mutex_lock(&scheduler->mutex);
+
+  for (slot = 0; slot < SCHEDULER_MAX_ENTRIES; slot ++)
+    if (!scheduler->entries[slot].pid)
+      break;
+  if (slot >= SCHEDULER_MAX_ENTRIES)
+  {
+    pthread_mutex_unlock(&scheduler->mutex);
+    return (-1);
+  }
+
+  e          = scheduler->entries + slot;
+  e->pid     = pid;
+  e->running = 0;
+  e->cost    = cost;
+  e->since   = hplip_time();
+
+  for (;;)
+  {
+    now       = hplip_time();
+    running   = 0;
+    best      = -1;
+    best_prio = 0.0;
+
+    for (i = 0, e = scheduler->entries; i < SCHEDULER_MAX_ENTRIES; i ++, e ++)
+    {
+      if (!e->pid)
+	continue;
+
+      // Remove entries of filter processes which died without
+      // leaving the scheduler
+      if (e->pid != pid && kill(e->pid, 0) && errno == ESRCH)
+      {
+	e->pid = 0;
+	continue;
+      }
+
+      if (e->running)
+	running ++;
+      else if ((prio = e->cost - SCHEDULER_AGING * (now - e->since)) <
+	       best_prio || best < 0)
+      {
+	best      = i;
+	best_prio = prio;
+      }
+    }
+
+    if (running < scheduler->max_running && best == slot)
+      break;
+
+    if (data->iscanceledfunc && data->iscanceledfunc(data->iscanceleddata))
+    {
+      scheduler->entries[slot].pid = 0;
+      pthread_cond_broadcast(&scheduler->cond);
+      pthread_mutex_unlock(&scheduler->mutex);
+      return (-2);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &timeout);
+    timeout.tv_sec ++;
+    if (pthread_cond_timedwait(&scheduler->cond, &scheduler->mutex,
+			       &timeout) == EOWNERDEAD)
+      pthread_mutex_consistent(&scheduler->mutex);
+  }
+
+  scheduler->entries[slot].running = 1;
+  *waited = now - scheduler->entries[slot].since;
+
+  // More conversions may be allowed to start
+  pthread_cond_broadcast(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  return (slot);
+}
+
+
+//
+// 'hplip_scheduler_leave()' - Mark a conversion as finished, so that
+//                             the next one can start
+//
+
+void
+hplip_scheduler_leave(int slot)
+{
+  hplip_scheduler_t *scheduler;
+
+
+  if (slot < 0 || (scheduler = hplip_scheduler()) == NULL)
+    return;
+
+  hplip_mutex_lock(&scheduler->mutex);
+  scheduler->entries[slot].pid = 0;
+  pthread_cond_broadcast(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+
+//
+// 'hplip_conversion_cost()' - Expected time for converting a job, from
+//                             the measurements on the printer, or
+//                             estimated from the input size
+//
+
+double
+hplip_conversion_cost(int inputfd,
+		      cf_filter_data_t *data,
+		      const pr_spooling_conversion_t *conversion,
+		      const char *jobclass)
+{
+  hplip_conversion_stats_t stats[CONVERSION_STATS_MAX];
+  struct stat st;
+  int i, num_stats;
+
+
+  if (data->printer)
+  {
+    num_stats = hplip_conversion_stats_load(data->printer, stats);
+    for (i = 0; i < num_stats; i ++)
+      if (!strcmp(stats[i].srctype, conversion->srctype) &&
+	  !strcmp(stats[i].dsttype, conversion->dsttype) &&
+	  !strcmp(stats[i].jobclass, jobclass) && stats[i].runs > 0)
+	return (stats[i].seconds - stats[i].blocked);
+  }
+
+  if (!fstat(inputfd, &st) && S_ISREG(st.st_mode))
+    return ((double)st.st_size / SCHEDULER_BYTES_PER_SEC);
+
+  return (1.0);
+}
+
+
+//
+// 'hplip_pipeline_fill()' - Thread reading the output of the conversion
+//                           into the queue, so that the conversion can
+//                           render the next pages while the driver and
+//                           the backend are still busy with the
+//                           previous ones
+//
+
+void *
+hplip_pipeline_fill(void *arg)
+{
+  hplip_pipeline_t *pipeline = (hplip_pipeline_t *)arg;
+  hplip_chunk_t *chunk = NULL;
+  ssize_t bytes;
+  double t;
+
+
+  for (;;)
+  {
+    if (!chunk && (chunk = (hplip_chunk_t *)malloc(sizeof(hplip_chunk_t))) ==
+		  NULL)
+    {
+      // Out of memory, fail the job, but keep reading so that the
+      // conversion can finish
+      char buf[4096];
+
+      pthread_mutex_lock(&pipeline->mutex);
+      pipeline->failed = 1;
+      pipeline->nomem  = 1;
+      pthread_cond_broadcast(&pipeline->cond);
+      pthread_mutex_unlock(&pipeline->mutex);
+
+      while ((bytes = read(pipeline->fd, buf, sizeof(buf))) > 0 ||
+	     (bytes < 0 && (errno == EINTR || errno == EAGAIN)));
+      break;
+    }
+
+    // Queue whatever is available, so that the end of a page does not
+    // wait for the beginning of the next one
+    while ((bytes = read(pipeline->fd, chunk->data,
+			 sizeof(chunk->data))) < 0 &&
+	   (errno == EINTR || errno == EAGAIN));
+
+    if (bytes <= 0)
+      break;
+
+    chunk->len = bytes;
+
+    pthread_mutex_lock(&pipeline->mutex);
+    if (pipeline->failed)
+    {
+      // Driver is gone, discard the output but keep reading so that the
+      // conversion can finish
+      pthread_mutex_unlock(&pipeline->mutex);
+      continue;
+    }
+
+    // Back pressure: Let the conversion wait if the driver is too far
+    // behind
+    t = hplip_time();
+    while (pipeline->queued >= CONVERSION_QUEUE_MAX && !pipeline->failed)
+      pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+    pipeline->stalled += hplip_time() - t;
+
+    chunk->next = NULL;
+    if (pipeline->last)
+      pipeline->last->next = chunk;
+    else
+      pipeline->first = chunk;
+    pipeline->last = chunk;
+    pipeline->queued += chunk->len;
+    chunk = NULL;
+
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->mutex);
+  }
+
+  free(chunk);
+
+  // The conversion is done, the time the driver and the backend still
+  // need does not count against the CPU budget
+  hplip_scheduler_leave(pipeline->slot);
+
+  pthread_mutex_lock(&pipeline->mutex);
+  pipeline->slot = -1;
+  pipeline->eof = 1;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+
+  return (NULL);
+}
+
+
+//
+// 'hplip_cache_job_discard()' - Close the render cache file of a job
+//                               and remove the file being written, if
+//                               any
+//
+
+void
+hplip_cache_job_discard(hplip_cache_job_t *cache)
+{
+  if (cache->fd >= 0)
+    close(cache->fd);
+  if (cache->tempfile[0])
+    unlink(cache->tempfile);
+
+  cache->fd          = -1;
+  cache->tempfile[0] = '\0';
+}
+
+
+//
+// 'hplip_cache_job_open()' - Look up the output of a job in the render
+//                            cache. Returns 1 on a hit, with the cache
+//                            file open for reading, otherwise 0, with a
+//                            file open for writing the output if it is
+//                            to be kept or to be sent for several copies
+//
+
+int
+hplip_cache_job_open(hplip_cache_job_t *cache,
+		     int *inputfd,
+		     int *inputseekable,
+		     cf_filter_data_t *data,
+		     const pr_spooling_conversion_t *conversion,
+		     int copies)
+{
+  char name[sizeof(cache->key) + 16];
+
+
+  memset(cache, 0, sizeof(hplip_cache_job_t));
+  cache->fd   = -1;
+  cache->size = hplip_render_cache_size();
+
+  // Multiple collated copies get converted only once, the test page
+  // and, if the cache is enabled, repeated jobs get their conversion
+  // output from the cache. Without the cache the output of users' jobs
+  // does not get kept
+  if (copies <= 0 ||
+      (cache->size <= 0 && copies == 1 && !hplip_testpage_size(*inputfd)) ||
+      !hplip_render_cache_key(inputfd, inputseekable, data, conversion,
+			      cache->key, sizeof(cache->key)) ||
+      !hplip_render_cache_file(cache->key, cache->file, sizeof(cache->file)))
+    return (0);
+
+  cache->keep = cache->size > 0 ||
+                !strncmp(cache->key, RENDER_CACHE_TESTPAGE,
+			 strlen(RENDER_CACHE_TESTPAGE));
+
+  if (cache->keep && (cache->fd = open(cache->file, O_RDONLY)) >= 0)
+  {
+    // Cache hit, mark as recently used
+    futimens(cache->fd, NULL);
+    hplip_metrics_count(HPLIP_METRIC_CACHE_HITS, HPLIP_METRIC_CACHE_HITS,
+			0.0);
+    return (1);
+  }
+
+  // Cache miss, save the output while sending it, under a name of its
+  // own until it is complete
+  if (cache->keep)
+    hplip_metrics_count(HPLIP_METRIC_CACHE_MISSES,
+			HPLIP_METRIC_CACHE_MISSES, 0.0);
+  else if (copies == 1)
+    return (0);
+
+  snprintf(name, sizeof(name), ".%s.%d", cache->key, (int)getpid());
+  if (!hplip_render_cache_file(name, cache->tempfile,
+			       sizeof(cache->tempfile)))
+    cache->tempfile[0] = '\0';
+  else if ((cache->fd = open(cache->tempfile, O_RDWR | O_CREAT | O_EXCL,
+			     0600)) < 0)
+  {
+    if (data->logfunc)
+      data->logfunc(data->logdata, CF_LOGLEVEL_WARN,
+		    "hplip_conversion_filter: Unable to create render cache file %s: %s",
+		    cache->tempfile, strerror(errno));
+    cache->tempfile[0] = '\0';
+  }
+
+  return (0);
+}
+
+
+//
+// 'hplip_cache_job_send()' - Send the output of a job from the render
+//                            cache (cache hit)
+//
+
+int
+hplip_cache_job_send(hplip_cache_job_t *cache,
+		     int outputfd,
+		     int copies,
+		     cf_filter_data_t *data,
+		     const pr_spooling_conversion_t *conversion,
+		     int traced)
+{
+  size_t total = 0,
+         copied = 0;
+  double start = hplip_time();
+  char args[64];
+  int status;
+
+
+  status = hplip_render_cache_replay(cache->fd, outputfd, 0, copies, &total,
+				     &copied);
+
+  if (data->logfunc)
+    data->logfunc(data->logdata, CF_LOGLEVEL_DEBUG,
+		  "hplip_conversion_filter: %s -> %s: From render cache %s, %d copies: %.3f sec, %lu bytes, %lu bytes copied in user space, status %d",
+		  conversion->srctype, conversion->dsttype, cache->key, copies,
+		  hplip_time() - start, (unsigned long)total,
+		  (unsigned long)copied, status);
+  hplip_metrics_job(data->printer, NULL, status == 0, -1.0, total, 0.0,
+		    0.0, 0.0);
+  if (traced)
+  {
+    snprintf(args, sizeof(args), "\"copies\":%d,\"bytes\":%lu", copies,
+	     (unsigned long)total);
+    hplip_trace_event(data, "render cache", "cache", start, hplip_time(),
+		      args);
+  }
+
+  hplip_cache_job_discard(cache);
+
+  return (status);
+}
+
+
+//
+// 'hplip_cache_job_finish()' - Send the remaining copies of a job from
+//                              the file its output was written to, then
+//                              make the file available for repeated
+//                              jobs if the output is to be kept
+//
+
+int
+hplip_cache_job_finish(hplip_cache_job_t *cache,
+		       int outputfd,
+		       int copies,
+		       cf_filter_data_t *data,
+		       int traced,
+		       size_t *total,
+		       size_t *copied)
+{
+  double start = hplip_time();
+  char args[64];
+  int status = 0;
+
+
+  if (hplip_render_cache_replay(cache->fd, outputfd, 1, copies, total,
+				copied))
+  {
+    if (data->logfunc)
+      data->logfunc(data->logdata, CF_LOGLEVEL_ERROR,
+		    "hplip_conversion_filter: Unable to send copies from render cache file %s: %s",
+		    cache->tempfile, strerror(errno));
+    status = 1;
+  }
+  if (traced && copies > 1)
+  {
+    snprintf(args, sizeof(args), "\"copies\":%d", copies - 1);
+    hplip_trace_event(data, "copies from render cache", "cache", start,
+		      hplip_time(), args);
+  }
+
+  // The file is complete, also if the printer did not take the copies
+  if (cache->keep && !rename(cache->tempfile, cache->file))
+    cache->tempfile[0] = '\0';
+
+  hplip_cache_job_discard(cache);
+
+  // Keep the cache in its limit and remove what killed filters left
+  hplip_render_cache_evict(cache->size);
+
+  return (status);
+}
+
+
+//
+// 'hplip_pipeline_run()' - Run the filters of a conversion in a separate
+//                          thread and pass their output on to the driver
+//                          through the queue, and also into the render
+//                          cache file if there is one. Leaves the
+//                          scheduler when the conversion is done and
+//                          closes the job's input. Returns the exit
+//                          status of the conversion
+//
+
+int
+hplip_pipeline_run(hplip_pipeline_t *pipeline,
+		   hplip_conversion_job_t *job,
+		   int slot,
+		   int outputfd,
+		   hplip_cache_job_t *cache)
+{
+  cf_filter_data_t *data = job->data;
+  hplip_chunk_t *chunk;
+  pthread_t conversion_tid,
+            fill_tid;
+  int queue_thread = 1,
+      pipefds[2],
+      status;
+  ssize_t written;
+  double start,
+         t;
+  char args[256];
+
+
+  memset(pipeline, 0, sizeof(hplip_pipeline_t));
+  pipeline->slot = slot;
+
+  // Run the filters in a separate thread, their output goes through
+  // us, so that we see how much gets sent and how long the driver and
+  // backend make us wait
+  if (pipe(pipefds))
+  {
+    if (data->logfunc)
+      data->logfunc(data->logdata, CF_LOGLEVEL_ERROR,
+		    "hplip_conversion_filter: Unable to create pipe: %s",
+		    strerror(errno));
+    hplip_scheduler_leave(slot);
+    close(job->inputfd);
+    return (1);
+  }
+
+  job->outputfd = pipefds[1];
+  job->status   = 1;
+
+  pthread_mutex_init(&pipeline->mutex, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+  pipeline->fd = pipefds[0];
+
+  start = hplip_time();
+
+  if (pthread_create(&conversion_tid, NULL, hplip_conversion_run, job))
+  {
+    if (data->logfunc)
+      data->logfunc(data->logdata, CF_LOGLEVEL_ERROR,
+		    "hplip_conversion_filter: Unable to start thread: %s",
+		    strerror(errno));
+    hplip_scheduler_leave(slot);
+    close(pipefds[0]);
+    close(pipefds[1]);
+    close(job->inputfd);
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->mutex);
+    return (1);
+  }
+
+  if (pthread_create(&fill_tid, NULL, hplip_pipeline_fill, pipeline))
+  {
+    // Without the queue the conversion waits whenever the driver is
+    // busy, but the job still gets printed
+    if (data->logfunc)
+      data->logfunc(data->logdata, CF_LOGLEVEL_WARN,
+		    "hplip_conversion_filter: Unable to start queue thread: %s",
+		    strerror(errno));
+    queue_thread = 0;
+  }
+
+  for (;;)
+  {
+    if (queue_thread)
+    {
+      pthread_mutex_lock(&pipeline->mutex);
+      t = hplip_time();
+      while (!pipeline->first && !pipeline->eof && !pipeline->nomem)
+	pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+      pipeline->idle += hplip_time() - t;
+      if ((chunk = pipeline->first) != NULL)
+      {
+	if ((pipeline->first = chunk->next) == NULL)
+	  pipeline->last = NULL;
+	pipeline->queued -= chunk->len;
+	pthread_cond_broadcast(&pipeline->cond);
+      }
+      pthread_mutex_unlock(&pipeline->mutex);
+    }
+    else
+    {
+      // No queue thread, read directly
+      ssize_t bytes;
+
+      if ((chunk = (hplip_chunk_t *)malloc(sizeof(hplip_chunk_t))) == NULL)
+      {
+	pipeline->nomem = 1;
+	break;
+      }
+      t = hplip_time();
+      while ((bytes = read(pipefds[0], chunk->data,
+			   sizeof(chunk->data))) < 0 &&
+	     (errno == EINTR || errno == EAGAIN));
+      pipeline->idle += hplip_time() - t;
+      if (bytes <= 0)
+      {
+	free(chunk);
+	chunk = NULL;
+	hplip_scheduler_leave(pipeline->slot);
+	pipeline->slot = -1;
+      }
+      else
+	chunk->len = bytes;
+    }
+
+    if (!chunk)
+      break;
+
+    pipeline->total += chunk->len;
+    if (cache->fd >= 0 &&
+	write(cache->fd, chunk->data, chunk->len) != (ssize_t)chunk->len)
+    {
+      // Cache full or broken, the job itself is not affected, copies
+      // get converted again
+      if (data->logfunc)
+	data->logfunc(data->logdata, CF_LOGLEVEL_WARN,
+		      "hplip_conversion_filter: Unable to write render cache file %s: %s",
+		      cache->tempfile, strerror(errno));
+      hplip_cache_job_discard(cache);
+      cache->failed = 1;
+    }
+    t = hplip_time();
+    if (pipeline->first_write == 0.0)
+      pipeline->first_write = t;
+    for (written = 0; written < chunk->len;)
+    {
+      ssize_t ret = write(outputfd, chunk->data + written,
+			  chunk->len - written);
+      if (ret < 0)
+      {
+	if (errno == EINTR || errno == EAGAIN)
+	  continue;
+	break;
+      }
+      written += ret;
+    }
+    pipeline->last_write = hplip_time();
+    pipeline->blocked += pipeline->last_write - t;
+
+    if (written < chunk->len)
+    {
+      // Driver does not take any more data
+      free(chunk);
+      if (!queue_thread)
+	break;
+      pthread_mutex_lock(&pipeline->mutex);
+      pipeline->failed = 1;
+      while ((chunk = pipeline->first) != NULL)
+      {
+	pipeline->first = chunk->next;
+	free(chunk);
+      }
+      pipeline->last = NULL;
+      pipeline->queued = 0;
+      pthread_cond_broadcast(&pipeline->cond);
+      pthread_mutex_unlock(&pipeline->mutex);
+      break;
+    }
+
+    free(chunk);
+  }
+
+  if (queue_thread)
+    pthread_join(fill_tid, NULL);
+  else
+  {
+    // Let the conversion finish
+    char buf[4096];
+
+    while (read(pipefds[0], buf, sizeof(buf)) > 0);
+  }
+  close(pipefds[0]);
+  pthread_join(conversion_tid, NULL);
+  hplip_scheduler_leave(pipeline->slot);
+  pipeline->slot = -1;
+  pthread_cond_destroy(&pipeline->cond);
+  pthread_mutex_destroy(&pipeline->mutex);
+
+  if (job->traced)
+  {
+    snprintf(args, sizeof(args), "\"status\":%d", job->status);
+    hplip_trace_event(data, "conversion", "conversion", start, hplip_time(),
+		      args);
+    if (pipeline->first_write > 0.0)
+    {
+      hplip_trace_event(data, "first data to driver", "driver",
+			pipeline->first_write, -1.0, NULL);
+      snprintf(args, sizeof(args), "\"bytes\":%lu,\"busy_sec\":%.3f",
+	       (unsigned long)pipeline->total, pipeline->blocked);
+      hplip_trace_event(data, "driver/backend", "driver",
+			pipeline->first_write, pipeline->last_write, args);
+    }
+  }
+
+  status = job->status;
+  if (pipeline->nomem)
+  {
+    if (data->logfunc)
+      data->logfunc(data->logdata, CF_LOGLEVEL_ERROR,
+		    "hplip_conversion_filter: Out of memory for queueing the conversion output");
+    status = 1;
+  }
+
+  return (status);
+}
+
+
+//
+// 'hplip_conversion_single()' - Filter data for converting only one
+//                               copy of a job
+//
+
+void
+hplip_conversion_single(cf_filter_data_t *data,
+			cf_filter_data_t *single)
+{
+  int i;
+
+
+  *single             = *data;
+  single->copies      = 1;
+  single->num_options = 0;
+  single->options     = NULL;
+  for (i = 0; i < data->num_options; i ++)
+    if (strcasecmp(data->options[i].name, "copies"))
+      single->num_options = cupsAddOption(data->options[i].name,
+					  data->options[i].value,
+					  single->num_options,
+					  &single->options);
+}
+
+
+//
+// 'hplip_conversion_retry()' - Convert the remaining copies of a job
+//                              again, when they cannot be sent from the
+//                              render cache file. Closes retryfd
+//
+
+int
+hplip_conversion_retry(hplip_conversion_t *conversion,
+		       cf_filter_data_t *single,
+		       int retryfd,
+		       int outputfd,
+		       int copies,
+		       int traced)
+{
+  char value[16],
+       args[64];
+  double start;
+  int retryout,
+      status;
+
+
+  if (retryfd < 0 || lseek(retryfd, 0, SEEK_SET) != 0 ||
+      (retryout = dup(outputfd)) < 0)
+  {
+    if (single->logfunc)
+      single->logfunc(single->logdata, CF_LOGLEVEL_ERROR,
+		      "hplip_conversion_filter: Only 1 of %d copies printed",
+		      copies);
+    if (retryfd >= 0)
+      close(retryfd);
+    return (1);
+  }
+
+  if (single->logfunc)
+    single->logfunc(single->logdata, CF_LOGLEVEL_WARN,
+		    "hplip_conversion_filter: Converting the remaining %d copies again",
+		    copies - 1);
+  snprintf(value, sizeof(value), "%d", copies - 1);
+  single->copies      = copies - 1;
+  single->num_options = cupsAddOption("copies", value, single->num_options,
+				      &single->options);
+
+  // cfFilterChain() closes both file descriptors
+  start  = hplip_time();
+  status = cfFilterChain(retryfd, retryout, 1, single,
+			 traced ? conversion->traced_filters :
+			 conversion->filters);
+  if (traced)
+  {
+    snprintf(args, sizeof(args), "\"copies\":%d,\"status\":%d", copies - 1,
+	     status);
+    hplip_trace_event(single, "copies converted again", "conversion", start,
+		      hplip_time(), args);
+  }
+
+  return (status);
+}
+
+
+//
+// 'hplip_conversion_filter()' - Filter function which runs the filters
+//                               of a spooling conversion, passes their
+//                               output on to the driver through a
+//                               bounded queue, and measures the time
+//                               and output size, so that the
+//                               scheduler knows the expected cost of
+//                               the printer's jobs
+//
+
+int
+hplip_conversion_filter(int inputfd,
+			int outputfd,
+			int inputseekable,
+			cf_filter_data_t *data,
+			void *parameters)
+{
+  hplip_conversion_t *conversion = (hplip_conversion_t *)parameters;
+  hplip_conversion_job_t job;
+  hplip_pipeline_t pipeline;
+  hplip_cache_job_t cache;
+  cf_filter_data_t single;
+  char jobclass[32],
+       args[256];
+  int copies,
+      retryfd = -1,
+      slot,
+      status = 1,
+      ok,
+      traced = hplip_trace_jobs() > 0 && data->printer;
+  size_t converted,
+         total,
+         copied = 0;
+  double begin = hplip_time(),
+         start,
+         waitstart,
+         waited;
+
+
+  // Render cache: Send the output from the cache if it is there
+  copies = hplip_render_cache_copies(data, conversion->orig);
+  if (hplip_cache_job_open(&cache, &inputfd, &inputseekable, data,
+			   conversion->orig, copies))
+  {
+    status = hplip_cache_job_send(&cache, outputfd, copies, data,
+				  conversion->orig, traced);
+    close(inputfd);
+    close(outputfd);
+    return (status);
+  }
+
+  if (cache.fd >= 0 && copies > 1)
+  {
+    // Convert one copy, the others get sent from the cache file. Keep
+    // the input for converting them again if the cache file cannot be
+    // written
+    if (inputseekable)
+      retryfd = dup(inputfd);
+    hplip_conversion_single(data, &single);
+  }
+  else
+    copies = 1;
+
+  hplip_job_class(inputfd, data, jobclass, sizeof(jobclass));
+
+  waitstart = hplip_time();
+  if (traced)
+    hplip_trace_event(data, "render cache lookup", "cache", begin,
+		      waitstart, NULL);
+
+  // Wait for our turn if too many conversions are running already
+  if ((slot = hplip_scheduler_enter(hplip_conversion_cost(inputfd, data,
+							  conversion->orig,
+							  jobclass),
+				    data, &waited)) == -2)
+  {
+    close(inputfd);
+    goto out;
+  }
+  if (waited >= 0.01)
+    hplip_metrics_count(HPLIP_METRIC_SCHED_WAITS,
+			HPLIP_METRIC_SCHED_WAIT_USEC, waited);
+  if (traced)
+    hplip_trace_event(data, "scheduler", "wait", waitstart, hplip_time(),
+		      NULL);
+  if (waited >= 1.0 && data->logfunc)
+    data->logfunc(data->logdata, CF_LOGLEVEL_INFO,
+		  "hplip_conversion_filter: Waited %.1f sec for other jobs' conversions",
+		  waited);
+
+  // Convert, the pipeline closes the input
+  job.conversion    = conversion;
+  job.inputfd       = inputfd;
+  job.inputseekable = inputseekable;
+  job.data          = (copies > 1 ? &single : data);
+  job.traced        = traced;
+
+  start     = hplip_time();
+  status    = hplip_pipeline_run(&pipeline, &job, slot, outputfd, &cache);
+  converted = total = pipeline.total;
+
+  // Remaining copies, from the cache file or, if it could not be
+  // written, converted again
+  if (status == 0 &&
+      (!data->iscanceledfunc || !data->iscanceledfunc(data->iscanceleddata)))
+  {
+    if (cache.fd >= 0)
+      status = hplip_cache_job_finish(&cache, outputfd, copies, data,
+				      traced, &total, &copied);
+    else if (cache.failed && copies > 1)
+    {
+      status = hplip_conversion_retry(conversion, &single, retryfd,
+				      outputfd, copies, traced);
+      retryfd = -1;
+    }
+  }
+
+  ok = status == 0 &&
+       (!data->iscanceledfunc || !data->iscanceledfunc(data->iscanceleddata));
+
+  if (data->logfunc)
+    data->logfunc(data->logdata, CF_LOGLEVEL_DEBUG,
+		  "hplip_conversion_filter: %s -> %s (%s): waited %.3f sec, %.3f sec, %lu bytes, %lu bytes copied in user space, driver/backend busy %.3f sec, driver/backend idle %.3f sec, conversion stalled %.3f sec, status %d",
+		  conversion->orig->srctype, conversion->orig->dsttype,
+		  jobclass, waited, hplip_time() - start,
+		  (unsigned long)total, (unsigned long)(converted + copied),
+		  pipeline.blocked, pipeline.idle, pipeline.stalled, status);
+
+  hplip_metrics_job(data->printer, conversion->orig, ok,
+		    hplip_time() - start, total, pipeline.blocked,
+		    pipeline.idle, pipeline.stalled);
+  if (traced)
+  {
+    snprintf(args, sizeof(args),
+	     "\"jobclass\":\"%s\",\"status\":%d,\"bytes\":%lu", jobclass,
+	     status, (unsigned long)total);
+    hplip_trace_event(data, "conversion filter", "conversion", begin,
+		      hplip_time(), args);
+  }
+
+  // Each job's wait for the scheduler, for the "Conversions" page
+  if (data->printer)
+    hplip_conversion_recent_add(data->printer, data->job_id, jobclass,
+				waited, hplip_time() - start, status);
+
+  // Only successful jobs tell the real cost of a conversion path
+  if (ok && data->printer)
+    hplip_conversion_stats_update(data->printer, conversion->orig,
+				  jobclass, hplip_time() - start, converted,
+				  pipeline.blocked);
+
+ out:
+
+  hplip_cache_job_discard(&cache);
+  if (copies > 1)
+    cupsFreeOptions(single.num_options, single.options);
+  if (retryfd >= 0)
+    close(retryfd);
+  close(outputfd);
+
+  return (status);
+}
+
+
+//
+// 'hplip_conversion()' - Wrap a spooling conversion of pappl-retrofit,
+//                        so that its cost gets measured
+//
+
+pr_spooling_conversion_t *
+hplip_conversion(const pr_spooling_conversion_t *orig)
+{
+  hplip_conversion_t *conversion;
+  pr_spooling_conversion_t *wrapped;
+  cf_filter_filter_in_chain_t *filter;
+  int i;
+
+
+  conversion = (hplip_conversion_t *)calloc(1, sizeof(hplip_conversion_t));
+  conversion->orig = orig;
+  conversion->filters = cupsArrayNew(NULL, NULL);
+  for (i = 0; i < orig->num_filters; i ++)
+    cupsArrayAdd(conversion->filters, (void *)&orig->filters[i]);
+
+  // Each filter wrapped to record its time in the job's trace
+  conversion->traced_filters = cupsArrayNew(NULL, NULL);
+  for (filter = (cf_filter_filter_in_chain_t *)
+	 cupsArrayFirst(conversion->filters);
+       filter;
+       filter = (cf_filter_filter_in_chain_t *)
+	 cupsArrayNext(conversion->filters))
+  {
+    cf_filter_filter_in_chain_t *traced;
+
+    traced = (cf_filter_filter_in_chain_t *)
+      calloc(1, sizeof(cf_filter_filter_in_chain_t));
+    traced->function = hplip_trace_filter;
+    traced->parameters = filter;
+    traced->name = filter->name;
+    cupsArrayAdd(conversion->traced_filters, traced);
+  }
+
+  wrapped = (pr_spooling_conversion_t *)
+    calloc(1, sizeof(pr_spooling_conversion_t) +
+	   sizeof(cf_filter_filter_in_chain_t));
+  wrapped->srctype = orig->srctype;
+  wrapped->dsttype = orig->dsttype;
+  wrapped->num_filters = 1;
+  wrapped->filters[0].function = hplip_conversion_filter;
+  wrapped->filters[0].parameters = conversion;
+  wrapped->filters[0].name = "hplip-conversion";
+
+  return (wrapped);
+}
+
+
+//
+// 'hplip_web_conversions()' - Printer web interface page showing the
+//                             measured times of the conversion paths
+//
+
+void
+hplip_web_conversions(
+    pappl_client_t *client,		// I - Client
+    pappl_printer_t *printer)		// I - Printer
+{
+  hplip_conversion_stats_t stats[CONVERSION_STATS_MAX],
+                           *s;
+  hplip_conversion_recent_t recent[CONVERSION_RECENT_JOBS],
+                            *r;
+  int i, num_stats, num_recent;
+
+
+  if (!papplClientHTMLAuthorize(client))
+    return;
+
+  num_stats = hplip_conversion_stats_load(papplPrinterGetName(printer),
+					  stats);
+  num_recent = hplip_conversion_recent_load(papplPrinterGetName(printer),
+					    recent);
+
+  if (!papplClientRespond(client, HTTP_STATUS_OK, NULL, "text/html", 0, 0))
+    return;
+  papplClientHTMLPrinterHeader(client, printer, "Conversions", 0, NULL,
+			       NULL);
+
+  papplClientHTMLPuts(client,
+		      "          <p>Time needed to convert the jobs into the printer's data format and to send them off, measured for each conversion path and class of job. These measurements give the expected conversion time of new jobs when several jobs wait for conversion.</p>\n");
+
+  if (num_stats == 0)
+  {
+    papplClientHTMLPuts(client,
+			"          <p>No jobs measured yet.</p>\n");
+  }
+  else
+  {
+    papplClientHTMLPuts(client,
+			"          <table class=\"list\">\n"
+			"            <thead>\n"
+			"              <tr><th>Input</th><th>Output</th><th>Job class</th><th>Jobs</th><th>Seconds</th><th>Bytes</th><th>Waiting for printer</th></tr>\n"
+			"            </thead>\n"
+			"            <tbody>\n");
+    for (i = 0, s = stats; i < num_stats; i ++, s ++)
+      papplClientHTMLPrintf(client,
+			    "              <tr><td>%s</td><td>%s</td><td>%s</td><td>%d</td><td>%.2f</td><td>%.0f</td><td>%.2f</td></tr>\n",
+			    s->srctype, s->dsttype, s->jobclass, s->runs,
+			    s->seconds, s->bytes, s->blocked);
+    papplClientHTMLPuts(client,
+			"            </tbody>\n"
+			"          </table>\n");
+  }
+
+  if (num_recent > 0)
+  {
+    // Newest job first
+    papplClientHTMLPuts(client,
+			"          <h2 class=\"title\">Recent Jobs</h2>\n"
+			"          <p>Time each job waited for the conversions of other jobs before its own conversion started.</p>\n"
+			"          <table class=\"list\">\n"
+			"            <thead>\n"
+			"              <tr><th>Job</th><th>Job class</th><th>Waiting for other jobs</th><th>Seconds</th><th>Status</th></tr>\n"
+			"            </thead>\n"
+			"            <tbody>\n");
+    for (i = num_recent - 1, r = recent + i; i >= 0; i --, r --)
+      papplClientHTMLPrintf(client,
+			    "              <tr><td>%d</td><td>%s</td><td>%.2f</td><td>%.2f</td><td>%s</td></tr>\n",
+			    r->job_id, r->jobclass, r->waited, r->seconds,
+			    r->status ? "Failed" : "OK");
+    papplClientHTMLPuts(client,
+			"            </tbody>\n"
+			"          </table>\n");
+  }
+
+  papplClientHTMLPrinterFooter(client);
+}
+
+
+//
+// 'hplip_web_traces()' - Printer web interface page listing the traces
+//                        of the printer's recent jobs, with a link to
+//                        each trace in Chrome's trace event format
+//
+
+void
+hplip_web_traces(
+    pappl_client_t *client,		// I - Client
+    pappl_printer_t *printer)		// I - Printer
+{
+  const char *printer_name = papplPrinterGetName(printer);
+  int		num_form = 0;		// Number of form variables
+  cups_option_t	*form = NULL;		// Form variables
+  const char	*val;
+  char		file[1024],
+		prefix[256],
+		*ptr,
+		*buf;
+  int		*jobs = NULL,
+		num_jobs = 0,
+		alloc_jobs = 0;
+  DIR		*dir;
+  struct dirent	*entry;
+  struct stat	st;
+  FILE		*fp;
+  int		i;
+
+
+  if (!papplClientHTMLAuthorize(client))
+    return;
+
+  // "?job=N" gets the trace of a job
+  num_form = papplClientGetForm(client, &form);
+  if ((val = cupsGetOption("job", num_form, form)) != NULL)
+  {
+    i = atoi(val);
+    cupsFreeOptions(num_form, form);
+    if (i <= 0 ||
+	!hplip_trace_file(printer_name, i, "json", file, sizeof(file)) ||
+	(fp = fopen(file, "r")) == NULL)
+    {
+      papplClientRespond(client, HTTP_STATUS_NOT_FOUND, NULL, NULL, 0, 0);
+      return;
+    }
+    if (fstat(fileno(fp), &st) ||
+	(buf = (char *)malloc((size_t)st.st_size + 1)) == NULL)
+    {
+      fclose(fp);
+      papplClientRespond(client, HTTP_STATUS_SERVER_ERROR, NULL, NULL, 0, 0);
+      return;
+    }
+    st.st_size = (off_t)fread(buf, 1, (size_t)st.st_size, fp);
+    fclose(fp);
+    if (papplClientRespond(client, HTTP_STATUS_OK, NULL, "application/json",
+			   0, (size_t)st.st_size))
+      httpWrite2(papplClientGetHTTP(client), buf, (size_t)st.st_size);
+    free(buf);
+    return;
+  }
+  cupsFreeOptions(num_form, form);
+
+  // Job IDs of the printer's traces, from the file names
+  if (hplip_printer_file(printer_name, TRACE_DIR, "", file, sizeof(file)) &&
+      (ptr = strrchr(file, '/')) != NULL)
+  {
+    *ptr++ = '\0';
+    snprintf(prefix, sizeof(prefix), "%s", ptr);
+    if ((dir = opendir(file)) != NULL)
+    {
+      while ((entry = readdir(dir)) != NULL)
+      {
+	if (strncmp(entry->d_name, prefix, strlen(prefix)) ||
+	    (ptr = strstr(entry->d_name, ".json")) == NULL || ptr[5])
+	  continue;
+	if (num_jobs >= alloc_jobs)
+	{
+	  int *temp = (int *)realloc(jobs, (size_t)(alloc_jobs + 64) *
+				     sizeof(int));
+	  if (!temp)
+	    break;
+	  jobs = temp;
+	  alloc_jobs += 64;
+	}
+	jobs[num_jobs ++] = atoi(entry->d_name + strlen(prefix));
+      }
+      closedir(dir);
+    }
+  }
+  if (num_jobs > 1)
+    qsort(jobs, (size_t)num_jobs, sizeof(int), hplip_compare_ints);
+
+  if (!papplClientRespond(client, HTTP_STATUS_OK, NULL, "text/html", 0, 0))
+  {
+    free(jobs);
+    return;
+  }
+  papplClientHTMLPrinterHeader(client, printer, "Traces", 0, NULL, NULL);
+
+  papplClientHTMLPrintf(client,
+			"          <p>Time line of each job's way through render cache, scheduler, the filters of the conversion, and driver and backend, for the last %d jobs. Open the traces in Chrome's trace viewer (chrome://tracing) or in Perfetto (ui.perfetto.dev). The traces of all printers' jobs are also appended to the file %s/%s/%s.</p>\n",
+			hplip_trace_jobs(), hplip_state_dir(), TRACE_DIR,
+			TRACE_FILE);
+
+  if (num_jobs == 0)
+    papplClientHTMLPuts(client,
+			"          <p>No jobs traced yet.</p>\n");
+  else
+  {
+    papplClientHTMLPuts(client,
+			"          <table class=\"list\">\n"
+			"            <thead>\n"
+			"              <tr><th>Job</th><th>Trace</th></tr>\n"
+			"            </thead>\n"
+			"            <tbody>\n");
+    for (i = num_jobs - 1; i >= 0; i --)
+      papplClientHTMLPrintf(client,
+			    "              <tr><td>%d</td><td><a href=\"?job=%d\">trace-%d.json</a></td></tr>\n",
+			    jobs[i], jobs[i], jobs[i]);
+    papplClientHTMLPuts(client,
+			"            </tbody>\n"
+			"          </table>\n");
+  }
+
+  papplClientHTMLPrinterFooter(client);
+  free(jobs);
+}
+
+
+//
+// 'hplip_printer_extra_web_if()' - Add button for plugin web
+//                                  interface page to print queue
+//                                  entries which need the plugin.
+//                                  Also call original function for
+//                                  adding the "Device Settings",
+//                                  page, needed especially for the
+//                                  PostScript printers, and add the
+//                                  "Conversions" page with the
+//                                  measured conversion times, and the
+//                                  "Traces" page
+//                                  when jobs get traced.
+//
+
+void
+hplip_printer_extra_web_if(pappl_printer_t *printer, // I - Printer
+			   void *data)               // I - Global data
+{
+  pr_printer_app_global_data_t *global_data =
+    (pr_printer_app_global_data_t *)data;
+  pappl_system_t   *system = prGetSystem(global_data);
+  pappl_pr_driver_data_t driver_data;
+  char             path[256];
+
+
+  // "Device Settings" page for PPDs with "Installable Options" group or
+  // PostScript query code for printer settings
+  prSetupDeviceSettingsPage(printer, data);
+
+  // "Conversions" page, showing how long the jobs take with each
+  // conversion path
+  papplPrinterGetPath(printer, "conversions", path, sizeof(path));
+  papplSystemAddResourceCallback(system, path, "text/html",
+				 (pappl_resource_cb_t)hplip_web_conversions,
+				 printer);
+  papplPrinterAddLink(printer, "Conversions", path,
+		      PAPPL_LOPTIONS_NAVIGATION | PAPPL_LOPTIONS_STATUS);
+
+  // "Traces" page, with the time line of each recent job, if jobs get
+  // traced
+  if (hplip_trace_jobs())
+  {
+    papplPrinterGetPath(printer, "traces", path, sizeof(path));
+    papplSystemAddResourceCallback(system, path, "text/html",
+				   (pappl_resource_cb_t)hplip_web_traces,
+				   printer);
+    papplPrinterAddLink(printer, "Traces", path, PAPPL_LOPTIONS_STATUS);
+  }
+
+  papplPrinterGetDriverData(printer, &driver_data);
+  if (strcasestr(driver_data.make_and_model, "proprietary plugin"))
+  {
+    // Printer needs the plugin, add a "Plugin" button to get to the
+    // plugin management web interface page to the printer's entry
+    papplPrinterAddLink(printer, "Plugin", "/plugin",
+			PAPPL_LOPTIONS_NAVIGATION | PAPPL_LOPTIONS_STATUS);
+  }
+}
+
+
+//
+// 'hplip_snmp_begin()' - Start an ASN.1 sequence in an SNMP request,
+//                        the length gets filled in by
+//                        hplip_snmp_end()
+//
+
+unsigned char *
+hplip_snmp_begin(unsigned char **ptr,
+		 unsigned char *end,
+		 int tag)
+{
+  unsigned char *lenptr;
+
+
+  if (!*ptr || end - *ptr < 4)
+  {
+    *ptr = NULL;
+    return (NULL);
+  }
+
+  // Long form length with 2 bytes, as the length is not known yet
+  *(*ptr) ++ = tag;
+  *(*ptr) ++ = 0x82;
+  lenptr = *ptr;
+  *ptr += 2;
+
+  return (lenptr);
+}
+
+
+//
+// 'hplip_snmp_end()' - End an ASN.1 sequence in an SNMP request
+//
+
+void
+hplip_snmp_end(unsigned char *lenptr,
+	       unsigned char *ptr)
+{
+  size_t len;
+
+
+  if (!lenptr || !ptr)
+    return;
+
+  len       = ptr - lenptr - 2;
+  lenptr[0] = (len >> 8) & 255;
+  lenptr[1] = len & 255;
+}
+
+
+//
+// 'hplip_snmp_put_int()' - Add an integer to an SNMP request
+//
+
+void
+hplip_snmp_put_int(unsigned char **ptr,
+		   unsigned char *end,
+		   long value)
+{
+  int len, i;
+
+
+  for (len = 1; len < (int)sizeof(long); len ++)
+    if (value >= -(1L << (8 * len - 1)) && value < (1L << (8 * len - 1)))
+      break;
+
+  if (!*ptr || end - *ptr < len + 2)
+  {
+    *ptr = NULL;
+    return;
+  }
+
+  *(*ptr) ++ = 0x02;
+  *(*ptr) ++ = len;
+  for (i = len - 1; i >= 0; i --)
+    *(*ptr) ++ = (value >> (8 * i)) & 255;
+}
+
+
+//
+// 'hplip_snmp_put_string()' - Add an octet string to an SNMP request
+//
+
+void
+hplip_snmp_put_string(unsigned char **ptr,
+		      unsigned char *end,
+		      const char *value)
+{
+  size_t len = strlen(value);
+
+
+  if (!*ptr || len > 127 || end - *ptr < (long)len + 2)
+  {
+    *ptr = NULL;
+    return;
+  }
+
+  *(*ptr) ++ = 0x04;
+  *(*ptr) ++ = len;
+  memcpy(*ptr, value, len);
+  *ptr += len;
+}
+
+
+//
+// 'hplip_snmp_put_varbind()' - Add an object ID with NULL value to an
+//                              SNMP request, the OID is terminated by -1
+//
+
+void
+hplip_snmp_put_varbind(unsigned char **ptr,
+		       unsigned char *end,
+		       const int *oid)
+{
+  unsigned char *seq, *lenptr;
+  int i, shift;
+
+
+  seq = hplip_snmp_begin(ptr, end, 0x30);
+
+  if (!*ptr || end - *ptr < 2 + 5 * 32 + 2)
+  {
+    *ptr = NULL;
+    return;
+  }
+
+  *(*ptr) ++ = 0x06;
+  lenptr = (*ptr) ++;
+  *(*ptr) ++ = oid[0] * 40 + oid[1];
+  for (i = 2; oid[i] >= 0; i ++)
+  {
+    for (shift = 28; shift > 0 && !(oid[i] >> shift); shift -= 7);
+    for (; shift > 0; shift -= 7)
+      *(*ptr) ++ = 0x80 | ((oid[i] >> shift) & 127);
+    *(*ptr) ++ = oid[i] & 127;
+  }
+  *lenptr = *ptr - lenptr - 1;
+
+  *(*ptr) ++ = 0x05;
+  *(*ptr) ++ = 0x00;
+
+  hplip_snmp_end(seq, *ptr);
+}
+
+
+//
+// 'hplip_snmp_bulk_request()' - Create an SNMPv2c GetBulkRequest. The
+//                               first "non_repeaters" OIDs are read
+//                               once, the other ones as columns of
+//                               tables. Returns the request's size
+//
+
+size_t
+hplip_snmp_bulk_request(unsigned char *buf,
+			size_t bufsize,
+			const char *community,
+			unsigned request_id,
+			int non_repeaters,
+			int max_repetitions,
+			const int * const *oids,
+			int num_oids)
+{
+  unsigned char *ptr = buf,
+                *end = buf + bufsize,
+                *message, *pdu, *varbinds;
+  int i;
+
+
+  message = hplip_snmp_begin(&ptr, end, 0x30);
+  hplip_snmp_put_int(&ptr, end, 1);		// SNMPv2c
+  hplip_snmp_put_string(&ptr, end, community);
+  pdu = hplip_snmp_begin(&ptr, end, 0xa5);	// GetBulkRequest-PDU
+  hplip_snmp_put_int(&ptr, end, request_id);
+  hplip_snmp_put_int(&ptr, end, non_repeaters);
+  hplip_snmp_put_int(&ptr, end, max_repetitions);
+  varbinds = hplip_snmp_begin(&ptr, end, 0x30);
+  for (i = 0; i < num_oids; i ++)
+    hplip_snmp_put_varbind(&ptr, end, oids[i]);
+  hplip_snmp_end(varbinds, ptr);
+  hplip_snmp_end(pdu, ptr);
+  hplip_snmp_end(message, ptr);
+
+  return (ptr ? (size_t)(ptr - buf) : 0);
+}
+
+
+//
+// 'hplip_snmp_get_header()' - Read tag and length of an ASN.1 element of
+//                             an SNMP answer
+//
+
+int
+hplip_snmp_get_header(const unsigned char **ptr,
+		      const unsigned char *end,
+		      int *tag,
+		      long *len)
+{
+  int i, n;
+
+
+  if (end - *ptr < 2)
+    return (0);
+
+  *tag = *(*ptr) ++;
+  if (**ptr & 0x80)
+  {
+    n = *(*ptr) ++ & 127;
+    if (n < 1 || n > 3 || end - *ptr < n)
+      return (0);
+    for (i = 0, *len = 0; i < n; i ++)
+      *len = (*len << 8) | *(*ptr) ++;
+  }
+  else
+    *len = *(*ptr) ++;
+
+  return (*len <= end - *ptr);
+}
+
+
+//
+// 'hplip_snmp_get_int()' - Read an integer (or counter, gauge, ...) from
+//                          an SNMP answer
+//
+
+int
+hplip_snmp_get_int(const unsigned char **ptr,
+		   const unsigned char *end,
+		   long *value)
+{
+  int tag;
+  long len, i;
+
+
+  if (!hplip_snmp_get_header(ptr, end, &tag, &len) || len < 1 || len > 8)
+    return (0);
+
+  *value = (tag == 0x02 && (**ptr & 0x80)) ? -1 : 0;
+  for (i = 0; i < len; i ++)
+    *value = (*value << 8) | *(*ptr) ++;
+
+  return (1);
+}
+
+
+//
+// 'hplip_snmp_answer()' - Read the values from an SNMP answer (Response
+//                         PDU). Returns the number of values, -1 on
+//                         error
+//
+
+int
+hplip_snmp_answer(const unsigned char *buf,
+		  size_t bytes,
+		  unsigned *request_id,
+		  hplip_snmp_value_t *values,
+		  int max_values)
+{
+  const unsigned char *ptr = buf,
+                      *end = buf + bytes,
+                      *vend, *oend;
+  hplip_snmp_value_t *v;
+  int tag, num_values = 0;
+  long len, value;
+
+
+  // Message: Sequence, version, community
+  if (!hplip_snmp_get_header(&ptr, end, &tag, &len) || tag != 0x30 ||
+      !hplip_snmp_get_int(&ptr, end, &value) ||
+      !hplip_snmp_get_header(&ptr, end, &tag, &len) || tag != 0x04)
+    return (-1);
+  ptr += len;
+
+  // Response-PDU: Request ID, error status, error index
+  if (!hplip_snmp_get_header(&ptr, end, &tag, &len) || tag != 0xa2 ||
+      !hplip_snmp_get_int(&ptr, end, &value))
+    return (-1);
+  *request_id = (unsigned)value;
+  if (!hplip_snmp_get_int(&ptr, end, &value) || value != 0 ||
+      !hplip_snmp_get_int(&ptr, end, &value))
+    return (-1);
+
+  // Variable bindings
+  if (!hplip_snmp_get_header(&ptr, end, &tag, &len) || tag != 0x30)
+    return (-1);
+
+  while (ptr < end && num_values < max_values)
+  {
+    if (!hplip_snmp_get_header(&ptr, end, &tag, &len) || tag != 0x30)
+      return (-1);
+    vend = ptr + len;
+
+    v = values + num_values;
+    memset(v, 0, sizeof(hplip_snmp_value_t));
+
+    // OID
+    if (!hplip_snmp_get_header(&ptr, vend, &tag, &len) || tag != 0x06 ||
+	len < 1)
+      return (-1);
+    oend = ptr + len;
+    v->oid[0] = *ptr / 40;
+    v->oid[1] = *ptr % 40;
+    v->oidlen = 2;
+    for (ptr ++; ptr < oend && v->oidlen < 32; v->oidlen ++)
+    {
+      v->oid[v->oidlen] = 0;
+      while (ptr < oend && (*ptr & 0x80))
+	v->oid[v->oidlen] = (v->oid[v->oidlen] << 7) | (*ptr ++ & 127);
+      if (ptr < oend)
+	v->oid[v->oidlen] = (v->oid[v->oidlen] << 7) | *ptr ++;
+    }
+    ptr = oend;
+
+    // Value
+    if (ptr >= vend)
+      return (-1);
+    switch (v->type = *ptr)
+    {
+      case 0x02 :			// Integer
+      case 0x41 :			// Counter32
+      case 0x42 :			// Gauge32
+      case 0x43 :			// TimeTicks
+	  if (!hplip_snmp_get_int(&ptr, vend, &v->integer))
+	    return (-1);
+	  break;
+      case 0x04 :			// Octet string
+	  if (!hplip_snmp_get_header(&ptr, vend, &tag, &len))
+	    return (-1);
+	  v->stringlen = len < (long)sizeof(v->string) ? (int)len :
+	                 (int)sizeof(v->string) - 1;
+	  memcpy(v->string, ptr, v->stringlen);
+	  break;
+      default :				// NULL, noSuchObject, endOfMibView,
+					// ...
+	  break;
+    }
+    ptr = vend;
+    num_values ++;
+  }
+
+  return (num_values);
+}
+
+
+//
+// 'hplip_snmp_index()' - Get the table index of a value, if it is in
+//                        the given table column, -1 otherwise. The OID
+//                        of the column is terminated by -1
+//
+
+int
+hplip_snmp_index(hplip_snmp_value_t *v,
+		 const int *column,
+		 int num_indexes)
+{
+  int i;
+
+
+  for (i = 0; column[i] >= 0; i ++)
+    if (i >= v->oidlen || v->oid[i] != column[i])
+      return (-1);
+
+  if (v->oidlen != i + num_indexes)
+    return (-1);
+
+  return (v->oid[v->oidlen - 1]);
+}
+
+
+//
+// 'hplip_dnssd_browser()' - Get the DNS-SD browser, NULL if it is not
+//                           running
+//
+
+hplip_dnssd_browser_t *
+hplip_dnssd_browser(hplip_dnssd_browser_t *new_browser)
+{
+  static hplip_dnssd_browser_t *browser = NULL;
+
+
+  if (new_browser)
+    browser = new_browser;
+
+  return (browser);
+}
+
+
+//
+// 'hplip_dnssd_address()' - Get the address of a printer found by the
+//                           DNS-SD browser, from the host name part of
+//                           its "dnssd:" URI, "<Name>.<Type>.<Domain>"
+//
+
+int
+hplip_dnssd_address(const char *fullname,
+		    char *address,
+		    size_t addresssize)
+{
+  hplip_dnssd_browser_t *browser;
+  hplip_dnssd_service_t *s;
+  char name[1024];
+  int i, found = 0;
+
+
+  if ((browser = hplip_dnssd_browser(NULL)) == NULL)
+    return (0);
+
+  snprintf(name, sizeof(name), "%s", fullname);
+  if ((i = (int)strlen(name)) > 0 && name[i - 1] == '.')
+    name[i - 1] = '\0';
+
+  pthread_mutex_lock(&browser->mutex);
+  for (i = 0, s = browser->services; i < browser->num_services; i ++, s ++)
+  {
+    size_t len = strlen(s->name),
+           typelen = strlen(s->type);
+
+    if (!strncmp(name, s->name, len) && name[len] == '.' &&
+	!strncmp(name + len + 1, s->type, typelen) &&
+	name[len + 1 + typelen] == '.' &&
+	!strcmp(name + len + typelen + 2, s->domain) && s->address[0])
+    {
+      snprintf(address, addresssize, "%s", s->address);
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&browser->mutex);
+
+  return (found);
+}
+
+
+//
+// 'hplip_snmp_host()' - Get the host name or IP address of a network
+//                       printer from its device URI
+//
+
+int
+hplip_snmp_host(const char *uri,
+		char *host,
+		size_t hostsize)
+{
+  const char *ptr;
+  char scheme[32],
+       userpass[256],
+       resource[256];
+  int port;
+
+
+  if (!strncmp(uri, "hp:/net/", 8))
+  {
+    // HPLIP: hp:/net/<Model>?ip=<IP>, ?zc=<ZeroConf name>, or
+    // ?hostname=<Host name>
+    if ((ptr = strstr(uri, "?ip=")) != NULL)
+      snprintf(host, hostsize, "%.*s", (int)strcspn(ptr + 4, "&"), ptr + 4);
+    else if ((ptr = strstr(uri, "?zc=")) != NULL)
+      snprintf(host, hostsize, "%.*s.local", (int)strcspn(ptr + 4, "&"),
+	       ptr + 4);
+    else if ((ptr = strstr(uri, "?hostname=")) != NULL)
+      snprintf(host, hostsize, "%.*s", (int)strcspn(ptr + 10, "&"),
+	       ptr + 10);
+    else
+      return (0);
+    return (host[0] != '\0');
+  }
+
+  // CUPS backends: cups:socket://<Host>:<Port>, cups:lpd://<Host>/...,
+  // cups:dnssd://<Name>.<Type>.<Domain>/
+  if (!strncmp(uri, "cups:", 5))
+    uri += 5;
+  if (httpSeparateURI(HTTP_URI_CODING_ALL, uri, scheme, sizeof(scheme),
+		      userpass, sizeof(userpass), host, (int)hostsize, &port,
+		      resource, sizeof(resource)) < HTTP_URI_STATUS_OK)
+    return (0);
+
+  // Printers found via DNS-SD: The address the browser has found for
+  // the service, it gets updated when the printer changes it
+  if (!strcmp(scheme, "dnssd"))
+    return (hplip_dnssd_address(host, host, hostsize));
+
+  if (strcmp(scheme, "socket") && strcmp(scheme, "lpd"))
+    return (0);
+
+  return (host[0] != '\0');
+}
+
+
+//
+// 'hplip_snmp_lookup_release()' - Drop a reference to an address
+//                                 look-up, freeing it with the last one
+//
+
+void
+hplip_snmp_lookup_release(hplip_snmp_lookup_t *lookup)
+{
+  if (lookup && __atomic_sub_fetch(&lookup->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(lookup);
+}
+
+
+//
+// 'hplip_snmp_lookup_run()' - Thread looking up the address of a printer
+//
+
+void *
+hplip_snmp_lookup_run(void *data)
+{
+  hplip_snmp_lookup_t *lookup = (hplip_snmp_lookup_t *)data;
+  struct addrinfo hints, *addrlist;
+
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+
+  if (!getaddrinfo(lookup->host, lookup->port, &hints, &addrlist))
+  {
+    memcpy(&lookup->addr, addrlist->ai_addr, addrlist->ai_addrlen);
+    lookup->addrlen = addrlist->ai_addrlen;
+    freeaddrinfo(addrlist);
+  }
+
+  __atomic_store_n(&lookup->done, 1, __ATOMIC_RELEASE);
+  hplip_snmp_lookup_release(lookup);
+
+  return (NULL);
+}
+
+
+//
+// 'hplip_snmp_lookup()' - Look up the address of a printer. IP addresses
+//                         get converted right away, names get looked up
+//                         in a separate thread, so that a slow name
+//                         server does not hold up the polling of the
+//                         other printers. Returns 1 when the address is
+//                         known, 0 while looking it up, -1 on error
+//
+
+int
+hplip_snmp_lookup(hplip_snmp_poller_t *poller,
+		  hplip_snmp_printer_t *p)
+{
+  hplip_snmp_lookup_t *lookup;
+  struct addrinfo hints, *addrlist;
+  pthread_t tid;
+
+
+  if ((lookup = p->lookup) != NULL)
+  {
+    if (!__atomic_load_n(&lookup->done, __ATOMIC_ACQUIRE))
+      return (0);
+
+    memcpy(&p->addr, &lookup->addr, sizeof(p->addr));
+    p->addrlen = lookup->addrlen;
+    p->lookup  = NULL;
+    hplip_snmp_lookup_release(lookup);
+
+    return (p->addrlen ? 1 : -1);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags    = AI_NUMERICHOST;
+
+  if (!getaddrinfo(p->host, poller->port, &hints, &addrlist))
+  {
+    memcpy(&p->addr, addrlist->ai_addr, addrlist->ai_addrlen);
+    p->addrlen = addrlist->ai_addrlen;
+    freeaddrinfo(addrlist);
+    return (1);
+  }
+
+  if ((lookup = (hplip_snmp_lookup_t *)
+       calloc(1, sizeof(hplip_snmp_lookup_t))) == NULL)
+    return (-1);
+  snprintf(lookup->host, sizeof(lookup->host), "%s", p->host);
+  snprintf(lookup->port, sizeof(lookup->port), "%s", poller->port);
+  lookup->refs = 2;
+
+  if (pthread_create(&tid, NULL, hplip_snmp_lookup_run, lookup))
+  {
+    free(lookup);
+    return (-1);
+  }
+  pthread_detach(tid);
+  p->lookup = lookup;
+
+  return (0);
+}
+
+
+//
+// 'hplip_snmp_update_printer()' - Add a printer of the system to the
+//                                 printers to be polled, or mark an
+//                                 already added one as still present
+//
+
+void
+hplip_snmp_update_printer(pappl_printer_t *printer,
+			  void *data)
+{
+  hplip_snmp_poller_t *poller = (hplip_snmp_poller_t *)data;
+  hplip_snmp_printer_t *p;
+  char uri[1024],
+       host[256];
+  int i;
+
+
+  if (!papplPrinterGetDeviceURI(printer, uri, sizeof(uri)) ||
+      !hplip_snmp_host(uri, host, sizeof(host)))
+    return;
+
+  for (i = 0, p = poller->printers; i < poller->num_printers; i ++, p ++)
+    if (p->id == papplPrinterGetID(printer))
+    {
+      if (strcmp(p->host, host))
+      {
+	// Device URI changed
+	snprintf(p->host, sizeof(p->host), "%s", host);
+	hplip_snmp_lookup_release(p->lookup);
+	p->lookup    = NULL;
+	p->addrlen   = 0;
+	p->next_poll = 0.0;
+      }
+      p->seen = 1;
+      return;
+    }
+
+  if (poller->num_printers >= poller->alloc_printers)
+  {
+    poller->alloc_printers += 16;
+    poller->printers = (hplip_snmp_printer_t *)
+      realloc(poller->printers,
+	      poller->alloc_printers * sizeof(hplip_snmp_printer_t));
+  }
+
+  p = poller->printers + poller->num_printers ++;
+  memset(p, 0, sizeof(hplip_snmp_printer_t));
+  p->id   = papplPrinterGetID(printer);
+  p->seen = 1;
+  snprintf(p->host, sizeof(p->host), "%s", host);
+}
+
+
+//
+// 'hplip_snmp_send()' - Poll a printer, with 2 GetBulk requests, one
+//                       for the status and the supply levels, one for
+//                       the supply names and colors
+//
+
+void
+hplip_snmp_send(hplip_snmp_poller_t *poller,
+		hplip_snmp_printer_t *p,
+		int fd,
+		unsigned request_id)
+{
+  static const int hrPrinterStatus[] =
+    { 1, 3, 6, 1, 2, 1, 25, 3, 5, 1, 1, -1 };
+  static const int hrPrinterDetectedErrorState[] =
+    { 1, 3, 6, 1, 2, 1, 25, 3, 5, 1, 2, -1 };
+  static const int prtMarkerSuppliesColorantIndex[] =
+    { 1, 3, 6, 1, 2, 1, 43, 11, 1, 1, 3, -1 };
+  static const int prtMarkerSuppliesClass[] =
+    { 1, 3, 6, 1, 2, 1, 43, 11, 1, 1, 4, -1 };
+  static const int prtMarkerSuppliesType[] =
+    { 1, 3, 6, 1, 2, 1, 43, 11, 1, 1, 5, -1 };
+  static const int prtMarkerSuppliesDescription[] =
+    { 1, 3, 6, 1, 2, 1, 43, 11, 1, 1, 6, -1 };
+  static const int prtMarkerSuppliesMaxCapacity[] =
+    { 1, 3, 6, 1, 2, 1, 43, 11, 1, 1, 8, -1 };
+  static const int prtMarkerSuppliesLevel[] =
+    { 1, 3, 6, 1, 2, 1, 43, 11, 1, 1, 9, -1 };
+  static const int prtMarkerColorantValue[] =
+    { 1, 3, 6, 1, 2, 1, 43, 12, 1, 1, 4, -1 };
+  static const int * const levels[] =
+  {
+    hrPrinterStatus,
+    hrPrinterDetectedErrorState,
+    prtMarkerSuppliesClass,
+    prtMarkerSuppliesType,
+    prtMarkerSuppliesMaxCapacity,
+    prtMarkerSuppliesLevel
+  };
+  static const int * const names[] =
+  {
+    prtMarkerSuppliesColorantIndex,
+    prtMarkerSuppliesDescription,
+    prtMarkerColorantValue
+  };
+  unsigned char buf[1024];
+  size_t bytes;
+
+
+  p->request_id   = request_id;
+  p->answers      = 0;
+  p->sent         = hplip_time();
+  p->num_supplies = 0;
+  p->status       = 0;
+  memset(p->error_state, 0, sizeof(p->error_state));
+  memset(p->supply_class, 0, sizeof(p->supply_class));
+  memset(p->supply_type, 0, sizeof(p->supply_type));
+  memset(p->supply_max, 0, sizeof(p->supply_max));
+  memset(p->supply_level, 0, sizeof(p->supply_level));
+  memset(p->supply_colorant, 0, sizeof(p->supply_colorant));
+  memset(p->supply_description, 0, sizeof(p->supply_description));
+  memset(p->colorant, 0, sizeof(p->colorant));
+
+  if ((bytes = hplip_snmp_bulk_request(buf, sizeof(buf), poller->community,
+				       request_id << 1, 2, SNMP_MAX_SUPPLIES,
+				       levels, 6)) > 0)
+    sendto(fd, buf, bytes, 0, (struct sockaddr *)&p->addr, p->addrlen);
+
+  if ((bytes = hplip_snmp_bulk_request(buf, sizeof(buf), poller->community,
+				       (request_id << 1) | 1, 0,
+				       SNMP_MAX_SUPPLIES, names, 3)) > 0)
+    sendto(fd, buf, bytes, 0, (struct sockaddr *)&p->addr, p->addrlen);
+}
+
+
+//
+// 'hplip_snmp_store()' - Store the values of an SNMP answer for a
+//                        printer
+//
+
+void
+hplip_snmp_store(hplip_snmp_printer_t *p,
+		 hplip_snmp_value_t *values,
+		 int num_values)
+{
+  static const int hrPrinterStatus[] =
+    { 1, 3, 6, 1, 2, 1, 25, 3, 5, 1, 1, -1 };
+  static const int hrPrinterDetectedErrorState[] =
+    { 1, 3, 6, 1, 2, 1, 25, 3, 5, 1, 2, -1 };
+  static const int prtMarkerSupplies[] =
+    { 1, 3, 6, 1, 2, 1, 43, 11, 1, 1, -1 };
+  static const int prtMarkerColorantValue[] =
+    { 1, 3, 6, 1, 2, 1, 43, 12, 1, 1, 4, -1 };
+  hplip_snmp_value_t *v;
+  int i, idx;
+
+
+  for (i = 0, v = values; i < num_values; i ++, v ++)
+  {
+    if (hplip_snmp_index(v, hrPrinterStatus, 1) >= 0 && v->type == 0x02)
+      p->status = (int)v->integer;
+    else if (hplip_snmp_index(v, hrPrinterDetectedErrorState, 1) >= 0 &&
+	     v->type == 0x04)
+    {
+      p->error_state[0] = v->stringlen > 0 ? v->string[0] : 0;
+      p->error_state[1] = v->stringlen > 1 ? v->string[1] : 0;
+    }
+    else if ((idx = hplip_snmp_index(v, prtMarkerColorantValue, 2)) >= 1 &&
+	     idx <= SNMP_MAX_SUPPLIES && v->type == 0x04)
+      snprintf(p->colorant[idx - 1], sizeof(p->colorant[0]), "%s",
+	       v->string);
+    else if (v->oidlen == 13 &&
+	     hplip_snmp_index(v, prtMarkerSupplies, 3) >= 1 &&
+	     (idx = v->oid[12]) <= SNMP_MAX_SUPPLIES)
+    {
+      // Column of the supplies table
+      if (idx > p->num_supplies)
+	p->num_supplies = idx;
+      idx --;
+
+      switch (v->oid[10])
+      {
+	case 3 :
+	    p->supply_colorant[idx] = (int)v->integer;
+	    break;
+	case 4 :
+	    p->supply_class[idx] = (int)v->integer;
+	    break;
+	case 5 :
+	    p->supply_type[idx] = (int)v->integer;
+	    break;
+	case 6 :
+	    snprintf(p->supply_description[idx],
+		     sizeof(p->supply_description[0]), "%s", v->string);
+	    break;
+	case 8 :
+	    p->supply_max[idx] = (int)v->integer;
+	    break;
+	case 9 :
+	    p->supply_level[idx] = (int)v->integer;
+	    break;
+      }
+    }
+  }
+}
+
+
+//
+// 'hplip_snmp_apply()' - Update supply levels and state reasons of a
+//                        printer from the polled values
+//
+
+void
+hplip_snmp_apply(hplip_snmp_poller_t *poller,
+		 hplip_snmp_printer_t *p)
+{
+  pappl_printer_t *printer;
+  pappl_supply_t supplies[SNMP_MAX_SUPPLIES];
+  pappl_preason_t reasons = PAPPL_PREASON_NONE,
+                  current;
+  int i, j, num_supplies = 0;
+  static const pappl_supply_type_t types[] =
+  {					// prtMarkerSuppliesType 1 to 34
+    PAPPL_SUPPLY_TYPE_OTHER,
+    PAPPL_SUPPLY_TYPE_UNKNOWN,
+    PAPPL_SUPPLY_TYPE_TONER,
+    PAPPL_SUPPLY_TYPE_WASTE_TONER,
+    PAPPL_SUPPLY_TYPE_INK,
+    PAPPL_SUPPLY_TYPE_INK_CARTRIDGE,
+    PAPPL_SUPPLY_TYPE_INK_RIBBON,
+    PAPPL_SUPPLY_TYPE_WASTE_INK,
+    PAPPL_SUPPLY_TYPE_OPC,
+    PAPPL_SUPPLY_TYPE_DEVELOPER,
+    PAPPL_SUPPLY_TYPE_FUSER_OIL,
+    PAPPL_SUPPLY_TYPE_SOLID_WAX,
+    PAPPL_SUPPLY_TYPE_RIBBON_WAX,
+    PAPPL_SUPPLY_TYPE_WASTE_WAX,
+    PAPPL_SUPPLY_TYPE_FUSER,
+    PAPPL_SUPPLY_TYPE_CORONA_WIRE,
+    PAPPL_SUPPLY_TYPE_FUSER_OIL_WICK,
+    PAPPL_SUPPLY_TYPE_CLEANER_UNIT,
+    PAPPL_SUPPLY_TYPE_FUSER_CLEANING_PAD,
+    PAPPL_SUPPLY_TYPE_TRANSFER_UNIT,
+    PAPPL_SUPPLY_TYPE_TONER_CARTRIDGE,
+    PAPPL_SUPPLY_TYPE_FUSER_OILER,
+    PAPPL_SUPPLY_TYPE_WATER,
+    PAPPL_SUPPLY_TYPE_WASTE_WATER,
+    PAPPL_SUPPLY_TYPE_GLUE_WATER_ADDITIVE,
+    PAPPL_SUPPLY_TYPE_WASTE_PAPER,
+    PAPPL_SUPPLY_TYPE_BINDING_SUPPLY,
+    PAPPL_SUPPLY_TYPE_BANDING_SUPPLY,
+    PAPPL_SUPPLY_TYPE_STITCHING_WIRE,
+    PAPPL_SUPPLY_TYPE_SHRINK_WRAP,
+    PAPPL_SUPPLY_TYPE_PAPER_WRAP,
+    PAPPL_SUPPLY_TYPE_STAPLES,
+    PAPPL_SUPPLY_TYPE_INSERTS,
+    PAPPL_SUPPLY_TYPE_COVERS
+  };
+  static const struct
+  {
+    const char		*name;		// prtMarkerColorantValue
+    pappl_supply_color_t color;		// PAPPL color
+  } colors[] =
+  {
+    { "black",		PAPPL_SUPPLY_COLOR_BLACK },
+    { "cyan",		PAPPL_SUPPLY_COLOR_CYAN },
+    { "gray",		PAPPL_SUPPLY_COLOR_GRAY },
+    { "green",		PAPPL_SUPPLY_COLOR_GREEN },
+    { "light cyan",	PAPPL_SUPPLY_COLOR_LIGHT_CYAN },
+    { "light gray",	PAPPL_SUPPLY_COLOR_LIGHT_GRAY },
+    { "light magenta",	PAPPL_SUPPLY_COLOR_LIGHT_MAGENTA },
+    { "magenta",	PAPPL_SUPPLY_COLOR_MAGENTA },
+    { "orange",		PAPPL_SUPPLY_COLOR_ORANGE },
+    { "violet",		PAPPL_SUPPLY_COLOR_VIOLET },
+    { "yellow",		PAPPL_SUPPLY_COLOR_YELLOW }
+  };
+  static const pappl_preason_t error_states[16] =
+  {					// hrPrinterDetectedErrorState bits
+    PAPPL_PREASON_MEDIA_LOW,
+    PAPPL_PREASON_MEDIA_EMPTY,
+    PAPPL_PREASON_TONER_LOW,
+    PAPPL_PREASON_TONER_EMPTY,
+    PAPPL_PREASON_DOOR_OPEN,
+    PAPPL_PREASON_MEDIA_JAM,
+    PAPPL_PREASON_OFFLINE,
+    PAPPL_PREASON_NONE,			// serviceRequested
+    PAPPL_PREASON_INPUT_TRAY_MISSING,
+    PAPPL_PREASON_NONE,			// outputTrayMissing
+    PAPPL_PREASON_MARKER_SUPPLY_EMPTY,	// markerSupplyMissing
+    PAPPL_PREASON_NONE,			// outputNearFull
+    PAPPL_PREASON_NONE,			// outputFull
+    PAPPL_PREASON_MEDIA_EMPTY,		// inputTrayEmpty
+    PAPPL_PREASON_NONE,			// overduePreventMaint
+    PAPPL_PREASON_NONE
+  };
+
+
+  if ((printer = papplSystemFindPrinter(poller->system, NULL, p->id,
+					NULL)) == NULL)
+    return;
+
+  for (i = 0; i < p->num_supplies; i ++)
+  {
+    pappl_supply_t *supply = supplies + num_supplies;
+
+    if (!p->supply_type[i])
+      continue;
+
+    memset(supply, 0, sizeof(pappl_supply_t));
+    snprintf(supply->description, sizeof(supply->description), "%s",
+	     p->supply_description[i]);
+    supply->type        = (p->supply_type[i] >= 1 && p->supply_type[i] <= 34) ?
+                          types[p->supply_type[i] - 1] :
+                          PAPPL_SUPPLY_TYPE_UNKNOWN;
+    supply->is_consumed = p->supply_class[i] != 4;
+					// 4 = receptacleThatIsFilled
+    if (p->supply_max[i] > 0 && p->supply_level[i] >= 0)
+      supply->level = p->supply_level[i] * 100 / p->supply_max[i];
+    else if (p->supply_level[i] == -3)	// Some remaining
+      supply->level = 50;
+    else
+      supply->level = -1;
+    if (supply->level > 100)
+      supply->level = 100;
+
+    supply->color = PAPPL_SUPPLY_COLOR_NO_COLOR;
+    if (p->supply_colorant[i] >= 1 &&
+	p->supply_colorant[i] <= SNMP_MAX_SUPPLIES)
+      for (j = 0; j < (int)(sizeof(colors) / sizeof(colors[0])); j ++)
+	if (!strcasecmp(p->colorant[p->supply_colorant[i] - 1],
+			colors[j].name))
+	  supply->color = colors[j].color;
+
+    num_supplies ++;
+  }
+
+  if (num_supplies > 0)
+    papplPrinterSetSupplies(printer, num_supplies, supplies);
+
+  for (i = 0; i < 16; i ++)
+    if (p->error_state[i / 8] & (0x80 >> (i % 8)))
+      reasons |= error_states[i];
+
+  // Only remove the reasons which the poller has set itself, not the
+  // ones set by the driver or the backend
+  current = papplPrinterGetReasons(printer);
+  papplPrinterSetReasons(printer, reasons, p->reasons & ~reasons);
+  p->reasons = (p->reasons & reasons) | (reasons & ~current);
+
+  // Poll more often while the printer is busy, also with jobs from
+  // other computers (hrPrinterStatus printing(4) or warmup(5))
+  p->next_poll = hplip_time() +
+                 (papplPrinterGetState(printer) == IPP_PSTATE_PROCESSING ||
+		  p->status == 4 || p->status == 5 ?
+		  SNMP_INTERVAL_BUSY : SNMP_INTERVAL_IDLE);
+}
+
+
+//
+// 'hplip_snmp_sender()' - Check whether an answer came from the address
+//                         a printer was polled at
+//
+
+int
+hplip_snmp_sender(hplip_snmp_printer_t *p,
+		  struct sockaddr_storage *from)
+{
+  if (from->ss_family != p->addr.ss_family)
+    return (0);
+
+  if (from->ss_family == AF_INET)
+  {
+    struct sockaddr_in *a = (struct sockaddr_in *)from,
+                       *b = (struct sockaddr_in *)&p->addr;
+
+    return (a->sin_port == b->sin_port &&
+	    a->sin_addr.s_addr == b->sin_addr.s_addr);
+  }
+  else if (from->ss_family == AF_INET6)
+  {
+    struct sockaddr_in6 *a = (struct sockaddr_in6 *)from,
+                        *b = (struct sockaddr_in6 *)&p->addr;
+
+    return (a->sin6_port == b->sin6_port &&
+	    !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)));
+  }
+
+  return (0);
+}
+
+
+//
+// 'hplip_snmp_poller()' - Thread polling supply levels and status of
+//                         all network printers, through one UDP socket
+//                         per address family
+//
+
+void *
+hplip_snmp_poller(void *data)
+{
+  hplip_snmp_poller_t *poller = (hplip_snmp_poller_t *)data;
+  hplip_snmp_printer_t *p;
+  hplip_snmp_value_t values[SNMP_MAX_VALUES];
+  unsigned char buf[65536];
+  struct pollfd pfds[2];
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  unsigned request_id = 1;
+  ssize_t bytes;
+  double now;
+  int i, j, fd, num_values, num_fds,
+      fds[2] = { -1, -1 };		// IPv4 and IPv6 sockets
+
+
+  while (!papplSystemIsShutdown(poller->system))
+  {
+    // Printers added, removed, or modified?
+    for (i = 0; i < poller->num_printers; i ++)
+      poller->printers[i].seen = 0;
+    papplSystemIteratePrinters(poller->system, hplip_snmp_update_printer,
+			       poller);
+    for (i = 0; i < poller->num_printers;)
+      if (!poller->printers[i].seen)
+      {
+	hplip_snmp_lookup_release(poller->printers[i].lookup);
+	memmove(poller->printers + i, poller->printers + i + 1,
+		(-- poller->num_printers - i) * sizeof(hplip_snmp_printer_t));
+      }
+      else
+	i ++;
+
+    now = hplip_time();
+    for (i = 0, p = poller->printers; i < poller->num_printers; i ++, p ++)
+    {
+      if (p->sent > 0.0 && now - p->sent > SNMP_TIMEOUT)
+      {
+	// No (complete) answer, retry less and less often, the printer
+	// may be off or may not support SNMP
+	p->sent = 0.0;
+	p->addrlen = 0;
+	if (p->failures < 8)
+	  p->failures ++;
+	p->next_poll = now + SNMP_INTERVAL_BUSY * (1 << p->failures);
+	if (p->next_poll > now + SNMP_INTERVAL_IDLE)
+	  p->next_poll = now + SNMP_INTERVAL_IDLE;
+      }
+
+      if (p->sent > 0.0 || now < p->next_poll)
+	continue;
+
+      if (!p->addrlen && (j = hplip_snmp_lookup(poller, p)) <= 0)
+      {
+	// Look up the address, once, not on every poll
+	if (j < 0)
+	  p->sent = now;		// Treat as timeout
+	continue;
+      }
+
+      // One socket for each address family, IPv6 sockets reach IPv4
+      // printers only with mapped addresses
+      j = p->addr.ss_family == AF_INET6;
+      if (fds[j] < 0 &&
+	  (fds[j] = socket(p->addr.ss_family, SOCK_DGRAM, 0)) < 0)
+      {
+	p->sent = now;
+	continue;
+      }
+
+      hplip_snmp_send(poller, p, fds[j], request_id ++);
+    }
+
+    // Wait for answers
+    for (j = 0, num_fds = 0; j < 2; j ++)
+      if (fds[j] >= 0)
+      {
+	pfds[num_fds].fd     = fds[j];
+	pfds[num_fds].events = POLLIN;
+	num_fds ++;
+      }
+
+    if (!num_fds)
+    {
+      sleep(1);
+      continue;
+    }
+
+    if (poll(pfds, num_fds, 1000) <= 0)
+      continue;
+
+    for (j = 0; j < num_fds; j ++)
+    {
+      if (!(pfds[j].revents & POLLIN))
+	continue;
+
+      fd = pfds[j].fd;
+      for (;;)
+      {
+	unsigned answer_id;
+
+	fromlen = sizeof(from);
+	if ((bytes = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT,
+			      (struct sockaddr *)&from, &fromlen)) <= 0)
+	  break;
+
+	if ((num_values = hplip_snmp_answer(buf, bytes, &answer_id, values,
+					    SNMP_MAX_VALUES)) < 0)
+	  continue;
+
+	for (i = 0, p = poller->printers; i < poller->num_printers;
+	     i ++, p ++)
+	  if (p->sent > 0.0 && p->request_id == answer_id >> 1 &&
+	      hplip_snmp_sender(p, &from))
+	    break;
+	if (i >= poller->num_printers)
+	  continue;
+
+	hplip_snmp_store(p, values, num_values);
+	p->answers |= 1 << (answer_id & 1);
+	if (p->answers == 3)
+	{
+	  p->sent     = 0.0;
+	  p->failures = 0;
+	  hplip_snmp_apply(poller, p);
+	}
+      }
+    }
+  }
+
+  for (j = 0; j < 2; j ++)
+    if (fds[j] >= 0)
+      close(fds[j]);
+  for (i = 0; i < poller->num_printers; i ++)
+    hplip_snmp_lookup_release(poller->printers[i].lookup);
+  free(poller->printers);
+  free(poller);
+
+  return (NULL);
+}
+
+
+//
+// 'hplip_snmp_start()' - Start polling supply levels and status of the
+//                        network printers via SNMP
+//
+
+void
+hplip_snmp_start(pappl_system_t *system)
+{
+  hplip_snmp_poller_t *poller;
+  pthread_t tid;
+  const char *community;
+
+
+  if ((community = getenv("SNMP_COMMUNITY")) == NULL)
+    community = SNMP_COMMUNITY;
+  if (!community[0])
+    return;
+
+  if ((poller = (hplip_snmp_poller_t *)
+       calloc(1, sizeof(hplip_snmp_poller_t))) == NULL)
+    return;
+  poller->system    = system;
+  poller->community = community;
+  if ((poller->port = getenv("SNMP_PORT")) == NULL || !poller->port[0])
+    poller->port = SNMP_PORT;
+
+  if (pthread_create(&tid, NULL, hplip_snmp_poller, poller))
+  {
+    papplLog(system, PAPPL_LOGLEVEL_ERROR,
+	     "Unable to start SNMP supply level polling: %s",
+	     strerror(errno));
+    free(poller);
+    return;
+  }
+  pthread_detach(tid);
+}
+
+
+//
+// 'hplip_dnssd_txt()' - Get the value of a TXT record of a service
+//
+
+void
+hplip_dnssd_txt(AvahiStringList *txt,
+		const char *key,
+		char *value,
+		size_t valuesize)
+{
+  AvahiStringList *item;
+  char *k = NULL,
+       *v = NULL;
+
+
+  value[0] = '\0';
+  if ((item = avahi_string_list_find(txt, key)) == NULL ||
+      avahi_string_list_get_pair(item, &k, &v, NULL) < 0)
+    return;
+
+  if (v)
+    snprintf(value, valuesize, "%s", v);
+  avahi_free(k);
+  avahi_free(v);
+}
+
+
+//
+// 'hplip_dnssd_find()' - Find a service in the table, -1 if it is not
+//                        there
+//
+
+int
+hplip_dnssd_find(hplip_dnssd_browser_t *browser,
+		 const char *name,
+		 const char *type,
+		 AvahiIfIndex interface,
+		 AvahiProtocol protocol)
+{
+  hplip_dnssd_service_t *s;
+  int i;
+
+
+  for (i = 0, s = browser->services; i < browser->num_services; i ++, s ++)
+    if (s->interface == interface && s->protocol == protocol &&
+	!strcmp(s->name, name) && !strcmp(s->type, type))
+      return (i);
+
+  return (-1);
+}
+
+
+//
+// 'hplip_dnssd_resolve_cb()' - Add a resolved service to the table
+//
+
+void
+hplip_dnssd_resolve_cb(AvahiServiceResolver *resolver,
+		       AvahiIfIndex interface,
+		       AvahiProtocol protocol,
+		       AvahiResolverEvent event,
+		       const char *name,
+		       const char *type,
+		       const char *domain,
+		       const char *host_name,
+		       const AvahiAddress *address,
+		       uint16_t port,
+		       AvahiStringList *txt,
+		       AvahiLookupResultFlags flags,
+		       void *data)
+{
+  hplip_dnssd_browser_t *browser = (hplip_dnssd_browser_t *)data;
+  hplip_dnssd_service_t service,
+			*s;
+  char mfg[128],
+       mdl[128],
+       cmd[128];
+  int i;
+
+
+  if (event != AVAHI_RESOLVER_FOUND)
+  {
+    papplLog(browser->system, PAPPL_LOGLEVEL_DEBUG,
+	     "DNS-SD: Unable to resolve \"%s\" (%s): %s", name, type,
+	     avahi_strerror(avahi_client_errno(browser->client)));
+    avahi_service_resolver_free(resolver);
+    return;
+  }
+
+  memset(&service, 0, sizeof(service));
+  snprintf(service.name, sizeof(service.name), "%s", name);
+  snprintf(service.type, sizeof(service.type), "%s", type);
+  snprintf(service.domain, sizeof(service.domain), "%s", domain);
+  avahi_address_snprint(service.address, sizeof(service.address), address);
+  if (address->proto == AVAHI_PROTO_INET6 &&
+      address->data.ipv6.address[0] == 0xfe &&
+      (address->data.ipv6.address[1] & 0xc0) == 0x80)
+  {
+    // Link-local IPv6 address, only valid with the network interface
+    size_t len = strlen(service.address);
+
+    snprintf(service.address + len, sizeof(service.address) - len, "%%%d",
+	     (int)interface);
+  }
+  service.port      = port;
+  service.interface = interface;
+  service.protocol  = protocol;
+  hplip_dnssd_txt(txt, "ty", service.make_and_model,
+		  sizeof(service.make_and_model));
+
+  // Device ID from the usb_... TXT records, as the CUPS dnssd backend
+  // does, falling back to make and model
+  hplip_dnssd_txt(txt, "usb_MFG", mfg, sizeof(mfg));
+  hplip_dnssd_txt(txt, "usb_MDL", mdl, sizeof(mdl));
+  hplip_dnssd_txt(txt, "usb_CMD", cmd, sizeof(cmd));
+  if (!mfg[0] && !mdl[0] && service.make_and_model[0])
+  {
+    snprintf(mfg, sizeof(mfg), "%.*s",
+	     (int)strcspn(service.make_and_model, " "),
+	     service.make_and_model);
+    snprintf(mdl, sizeof(mdl), "%s",
+	     service.make_and_model + strlen(mfg) +
+	     (service.make_and_model[strlen(mfg)] ? 1 : 0));
+  }
+  if (mfg[0] || mdl[0])
+    snprintf(service.device_id, sizeof(service.device_id),
+	     "MFG:%s;MDL:%s;%s%s%s", mfg, mdl, cmd[0] ? "CMD:" : "", cmd,
+	     cmd[0] ? ";" : "");
+
+  papplLog(browser->system, PAPPL_LOGLEVEL_DEBUG,
+	   "DNS-SD: Found \"%s\" (%s) at %s:%d, device ID \"%s\"", name, type,
+	   service.address, port, service.device_id);
+
+  pthread_mutex_lock(&browser->mutex);
+  if ((i = hplip_dnssd_find(browser, name, type, interface, protocol)) >= 0)
+    browser->services[i] = service;
+  else
+  {
+    if (browser->num_services >= browser->alloc_services)
+    {
+      if ((s = (hplip_dnssd_service_t *)
+	   realloc(browser->services, (size_t)(browser->alloc_services + 16) *
+		   sizeof(hplip_dnssd_service_t))) == NULL)
+      {
+	pthread_mutex_unlock(&browser->mutex);
+	avahi_service_resolver_free(resolver);
+	return;
+      }
+      browser->services = s;
+      browser->alloc_services += 16;
+    }
+    browser->services[browser->num_services ++] = service;
+  }
+  pthread_mutex_unlock(&browser->mutex);
+
+  avahi_service_resolver_free(resolver);
+}
+
+
+//
+// 'hplip_dnssd_browse_cb()' - Resolve services appearing on the network,
+//                             remove disappearing ones from the table
+//
+
+void
+hplip_dnssd_browse_cb(AvahiServiceBrowser *b,
+		      AvahiIfIndex interface,
+		      AvahiProtocol protocol,
+		      AvahiBrowserEvent event,
+		      const char *name,
+		      const char *type,
+		      const char *domain,
+		      AvahiLookupResultFlags flags,
+		      void *data)
+{
+  hplip_dnssd_browser_t *browser = (hplip_dnssd_browser_t *)data;
+  int i;
+
+
+  switch (event)
+  {
+    case AVAHI_BROWSER_NEW :
+        // Resolve to IPv4 or IPv6 addresses, whichever the printer has
+        if (avahi_service_resolver_new(browser->client, interface, protocol,
+				       name, type, domain, AVAHI_PROTO_UNSPEC,
+				       0, hplip_dnssd_resolve_cb,
+				       browser) == NULL)
+	  papplLog(browser->system, PAPPL_LOGLEVEL_DEBUG,
+		   "DNS-SD: Unable to resolve \"%s\" (%s): %s", name, type,
+		   avahi_strerror(avahi_client_errno(browser->client)));
+	break;
+
+    case AVAHI_BROWSER_REMOVE :
+        papplLog(browser->system, PAPPL_LOGLEVEL_DEBUG,
+		 "DNS-SD: \"%s\" (%s) removed", name, type);
+        pthread_mutex_lock(&browser->mutex);
+	if ((i = hplip_dnssd_find(browser, name, type, interface,
+				  protocol)) >= 0)
+	{
+	  browser->num_services --;
+	  memmove(browser->services + i, browser->services + i + 1,
+		  (size_t)(browser->num_services - i) *
+		  sizeof(hplip_dnssd_service_t));
+	}
+        pthread_mutex_unlock(&browser->mutex);
+	break;
+
+    case AVAHI_BROWSER_FAILURE :
+        papplLog(browser->system, PAPPL_LOGLEVEL_ERROR,
+		 "DNS-SD: Browsing for %s failed: %s", type,
+		 avahi_strerror(avahi_client_errno(browser->client)));
+	break;
+
+    default :
+	break;
+  }
+}
+
+
+//
+// 'hplip_dnssd_client_cb()' - (Re-)create the service browsers when
+//                             avahi-daemon is (again) running, drop them
+//                             and the found services when it goes away,
+//                             replace the client when it failed
+//
+
+void
+hplip_dnssd_client_cb(AvahiClient *client,
+		      AvahiClientState state,
+		      void *data)
+{
+  hplip_dnssd_browser_t *browser = (hplip_dnssd_browser_t *)data;
+  int i, error;
+
+
+  // Called already from within avahi_client_new()
+  browser->client = client;
+
+  if (state == AVAHI_CLIENT_S_RUNNING)
+  {
+    for (i = 0; i < browser->num_types; i ++)
+      if (!browser->browsers[i] &&
+	  (browser->browsers[i] =
+	   avahi_service_browser_new(client, AVAHI_IF_UNSPEC,
+				     AVAHI_PROTO_UNSPEC, browser->types[i],
+				     NULL, 0, hplip_dnssd_browse_cb,
+				     browser)) == NULL)
+	papplLog(browser->system, PAPPL_LOGLEVEL_ERROR,
+		 "DNS-SD: Unable to browse for %s: %s", browser->types[i],
+		 avahi_strerror(avahi_client_errno(client)));
+  }
+  else if (state == AVAHI_CLIENT_CONNECTING || state == AVAHI_CLIENT_FAILURE)
+  {
+    papplLog(browser->system, PAPPL_LOGLEVEL_WARN,
+	     "DNS-SD: Lost connection to avahi-daemon, waiting for it");
+    for (i = 0; i < browser->num_types; i ++)
+      if (browser->browsers[i])
+      {
+	avahi_service_browser_free(browser->browsers[i]);
+	browser->browsers[i] = NULL;
+      }
+    pthread_mutex_lock(&browser->mutex);
+    browser->num_services = 0;
+    pthread_mutex_unlock(&browser->mutex);
+
+    if (state == AVAHI_CLIENT_FAILURE)
+    {
+      // The client is dead, also with AVAHI_CLIENT_NO_FAIL, replace it
+      // by a new one which waits for avahi-daemon
+      papplLog(browser->system, PAPPL_LOGLEVEL_DEBUG,
+	       "DNS-SD: Client failed: %s, reconnecting",
+	       avahi_strerror(avahi_client_errno(client)));
+      avahi_client_free(client);
+      browser->client = NULL;
+      if (avahi_client_new(avahi_threaded_poll_get(browser->poll),
+			   AVAHI_CLIENT_NO_FAIL, hplip_dnssd_client_cb,
+			   browser, &error) == NULL)
+	papplLog(browser->system, PAPPL_LOGLEVEL_ERROR,
+		 "DNS-SD: Unable to reconnect to avahi-daemon: %s",
+		 avahi_strerror(error));
+    }
+  }
+}
+
+
+//
+// 'hplip_dnssd_list()' - List the printers currently found via DNS-SD,
+//                        as URIs of the CUPS dnssd backend
+//
+
+bool
+hplip_dnssd_list(pappl_device_cb_t cb,
+		 void *data,
+		 pappl_deverror_cb_t err_cb,
+		 void *err_data)
+{
+  hplip_dnssd_browser_t *browser;
+  hplip_dnssd_service_t *s;
+  char uri[1024],
+       devuri[1024],
+       host[1024],
+       info[512];
+  const char *scheme;
+  int i, j;
+  bool ret = false;
+  double start = hplip_time();
+
+
+  if ((browser = hplip_dnssd_browser(NULL)) == NULL)
+    return (false);
+
+  pthread_mutex_lock(&browser->mutex);
+  for (i = 0, s = browser->services; i < browser->num_services && !ret;
+       i ++, s ++)
+  {
+    // Services appear once per interface and IP protocol
+    for (j = 0; j < i; j ++)
+      if (!strcmp(browser->services[j].name, s->name) &&
+	  !strcmp(browser->services[j].type, s->type))
+	break;
+    if (j < i)
+      continue;
+
+    if (!strcmp(s->type, "_pdl-datastream._tcp"))
+      scheme = "socket";
+    else if (!strcmp(s->type, "_printer._tcp"))
+      scheme = "lpd";
+    else if (!strcmp(s->type, "_ipp._tcp"))
+      scheme = "ipp";
+    else if (!strcmp(s->type, "_ipps._tcp"))
+      scheme = "ipps";
+    else
+      continue;
+
+    // The dnssd backend resolves the service for each job, so the URI
+    // stays valid when the printer gets a new IP address, and it
+    // prints via the protocol of the service type
+    snprintf(host, sizeof(host), "%s.%s.%s", s->name, s->type, s->domain);
+    httpAssembleURI(HTTP_URI_CODING_ALL, devuri, sizeof(devuri), "dnssd",
+		    NULL, host, 0, "/");
+    snprintf(uri, sizeof(uri), "cups:%s", devuri);
+    snprintf(info, sizeof(info), "%s (%s)", s->name,
+	     s->make_and_model[0] ? s->make_and_model : scheme);
+
+    ret = (cb)(info, uri, s->device_id, data);
+  }
+  pthread_mutex_unlock(&browser->mutex);
+
+  hplip_metrics_count(HPLIP_METRIC_DNSSD_LISTS, HPLIP_METRIC_DNSSD_LIST_USEC,
+		      hplip_time() - start);
+
+  return (ret);
+}
+
+
+//
+// 'hplip_dnssd_open()' - Open callback for the DNS-SD device scheme:
+//                        Found printers are used via the CUPS backends,
+//                        so this never succeeds
+//
+
+bool
+hplip_dnssd_open(pappl_device_t *device,
+		 const char *device_uri,
+		 const char *name)
+{
+  papplDeviceError(device, "Use the \"cups:\" URI of the printer instead");
+  return (false);
+}
+
+
+//
+// 'hplip_dnssd_close()' - Close callback for the DNS-SD device scheme
+//
+
+void
+hplip_dnssd_close(pappl_device_t *device)
+{
+}
+
+
+//
+// 'hplip_dnssd_read()' - Read callback for the DNS-SD device scheme
+//
+
+ssize_t
+hplip_dnssd_read(pappl_device_t *device,
+		 void *buffer,
+		 size_t bytes)
+{
+  return (-1);
+}
+
+
+//
+// 'hplip_dnssd_write()' - Write callback for the DNS-SD device scheme
+//
+
+ssize_t
+hplip_dnssd_write(pappl_device_t *device,
+		  const void *buffer,
+		  size_t bytes)
+{
+  return (-1);
+}
+
+
+//
+// 'hplip_dnssd_start()' - Start the long-lived DNS-SD browser, keeping a
+//                         table of the network printers up to date, and
+//                         register it for device discovery
+//
+
+void
+hplip_dnssd_start(pappl_system_t *system)
+{
+  hplip_dnssd_browser_t *browser;
+  const char *services,
+	     *ptr;
+  size_t len;
+  int error;
+
+
+  if ((services = getenv("DNSSD_SERVICES")) == NULL)
+    services = DNSSD_SERVICES;
+  if (!services[0])
+    return;
+
+  if ((browser = (hplip_dnssd_browser_t *)
+       calloc(1, sizeof(hplip_dnssd_browser_t))) == NULL)
+    return;
+  pthread_mutex_init(&browser->mutex, NULL);
+  browser->system = system;
+  for (ptr = services; *ptr && browser->num_types < DNSSD_MAX_SERVICES;
+       ptr += len)
+  {
+    ptr += strspn(ptr, ", ");
+    if ((len = strcspn(ptr, ", ")) > 0 &&
+	len < sizeof(browser->types[0]))
+      snprintf(browser->types[browser->num_types ++],
+	       sizeof(browser->types[0]), "%.*s", (int)len, ptr);
+  }
+
+  // With AVAHI_CLIENT_NO_FAIL the client waits for avahi-daemon to
+  // start and reconnects when it restarts
+  if ((browser->poll = avahi_threaded_poll_new()) == NULL ||
+      avahi_client_new(avahi_threaded_poll_get(browser->poll),
+		       AVAHI_CLIENT_NO_FAIL, hplip_dnssd_client_cb, browser,
+		       &error) == NULL ||
+      avahi_threaded_poll_start(browser->poll) < 0)
+  {
+    papplLog(system, PAPPL_LOGLEVEL_ERROR,
+	     "Unable to start DNS-SD printer discovery: %s",
+	     browser->poll ? avahi_strerror(error) : "Out of memory");
+    if (browser->client)
+      avahi_client_free(browser->client);
+    if (browser->poll)
+      avahi_threaded_poll_free(browser->poll);
+    free(browser);
+    return;
+  }
+
+  hplip_dnssd_browser(browser);
+  papplDeviceAddScheme("hplip-dnssd", PAPPL_DEVTYPE_DNS_SD, hplip_dnssd_list,
+		       hplip_dnssd_open, hplip_dnssd_close, hplip_dnssd_read,
+		       hplip_dnssd_write, NULL, NULL);
+}
+
+
+//
+// 'hplip_metrics_print_histogram()' - Print a histogram of durations
+//
+
+void
+hplip_metrics_print_histogram(FILE *fp,
+			      const char *name,
+			      const char *label,
+			      const char *value,
+			      hplip_histogram_t *histogram)
+{
+  static const double bounds[METRICS_NUM_BUCKETS] = METRICS_BUCKETS;
+  unsigned long long count = 0;
+  char buf[256];
+  int i;
+
+
+  hplip_metrics_escape(value, buf, sizeof(buf));
+  for (i = 0; i <= METRICS_NUM_BUCKETS; i ++)
+  {
+    count += histogram->buckets[i];
+    if (i < METRICS_NUM_BUCKETS)
+      fprintf(fp, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", name, label, buf,
+	      bounds[i], count);
+    else
+      fprintf(fp, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label,
+	      buf, count);
+  }
+  fprintf(fp, "%s_sum{%s=\"%s\"} %.6f\n", name, label, buf,
+	  histogram->usec / 1000000.0);
+  fprintf(fp, "%s_count{%s=\"%s\"} %llu\n", name, label, buf,
+	  histogram->count);
+}
+
+
+//
+// 'hplip_web_metrics()' - "/metrics" web resource, the metrics in the
+//                         text format of Prometheus
+//
+
+void
+hplip_web_metrics(pappl_client_t *client,
+		  pappl_system_t *system)
+{
+  static const char * const phases[] =
+  {
+    "download_file",
+    "download",
+    "install",
+    "remove"
+  };
+  hplip_metrics_t *metrics;
+  hplip_metrics_shard_t total;
+  hplip_printer_metrics_t *p;
+  hplip_dnssd_browser_t *browser;
+  unsigned long long *sum,
+		     *val;
+  FILE *fp;
+  const char *env;
+  char *text = NULL,
+       buf[256],
+       cachefile[1024];
+  size_t textlen = 0;
+  struct stat st;
+  int i, j, num;
+
+
+  if ((metrics = hplip_metrics()) == NULL)
+  {
+    papplClientRespond(client, HTTP_STATUS_SERVICE_UNAVAILABLE, NULL, NULL,
+		       0, 0);
+    return;
+  }
+
+  // Add up the shards, they consist of counters only
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < METRICS_SHARDS; i ++)
+    for (j = 0, sum = (unsigned long long *)&total,
+	   val = (unsigned long long *)&metrics->shards[i];
+	 j < (int)(sizeof(total) / sizeof(unsigned long long));
+	 j ++, sum ++, val ++)
+      *sum += __atomic_load_n(val, __ATOMIC_RELAXED);
+
+  if ((fp = open_memstream(&text, &textlen)) == NULL)
+  {
+    papplClientRespond(client, HTTP_STATUS_SERVER_ERROR, NULL, NULL, 0, 0);
+    return;
+  }
+
+  num = __atomic_load_n(&metrics->num_printers, __ATOMIC_ACQUIRE);
+  fputs("# HELP hplip_jobs_total Jobs converted and sent to the printer in spooling mode.\n"
+	"# TYPE hplip_jobs_total counter\n", fp);
+  for (i = 0, p = total.printers; i < num; i ++, p ++)
+  {
+    hplip_metrics_escape(metrics->printers[i], buf, sizeof(buf));
+    fprintf(fp, "hplip_jobs_total{printer=\"%s\",status=\"ok\"} %llu\n",
+	    buf, p->jobs);
+    fprintf(fp, "hplip_jobs_total{printer=\"%s\",status=\"failed\"} %llu\n",
+	    buf, p->failed);
+  }
+  fputs("# HELP hplip_job_duration_seconds Time from the creation of a successful job until its completion.\n"
+	"# TYPE hplip_job_duration_seconds histogram\n", fp);
+  for (i = 0, p = total.printers; i < num; i ++, p ++)
+    hplip_metrics_print_histogram(fp, "hplip_job_duration_seconds",
+				  "printer", metrics->printers[i],
+				  &p->duration);
+  fputs("# HELP hplip_backend_sent_bytes_total Bytes sent to the driver and backend.\n"
+	"# TYPE hplip_backend_sent_bytes_total counter\n", fp);
+  for (i = 0, p = total.printers; i < num; i ++, p ++)
+    fprintf(fp, "hplip_backend_sent_bytes_total{printer=\"%s\"} %llu\n",
+	    hplip_metrics_escape(metrics->printers[i], buf, sizeof(buf)),
+	    p->bytes);
+  fputs("# HELP hplip_backend_send_seconds_total Time waited for the driver and backend to take the data.\n"
+	"# TYPE hplip_backend_send_seconds_total counter\n", fp);
+  for (i = 0, p = total.printers; i < num; i ++, p ++)
+    fprintf(fp, "hplip_backend_send_seconds_total{printer=\"%s\"} %.6f\n",
+	    hplip_metrics_escape(metrics->printers[i], buf, sizeof(buf)),
+	    p->send_usec / 1000000.0);
+  fputs("# HELP hplip_backend_idle_seconds_total Time the driver and backend waited for the conversion to produce data.\n"
+	"# TYPE hplip_backend_idle_seconds_total counter\n", fp);
+  for (i = 0, p = total.printers; i < num; i ++, p ++)
+    fprintf(fp, "hplip_backend_idle_seconds_total{printer=\"%s\"} %.6f\n",
+	    hplip_metrics_escape(metrics->printers[i], buf, sizeof(buf)),
+	    p->idle_usec / 1000000.0);
+  fputs("# HELP hplip_conversion_stall_seconds_total Time the conversion waited for space in the queue to the driver.\n"
+	"# TYPE hplip_conversion_stall_seconds_total counter\n", fp);
+  for (i = 0, p = total.printers; i < num; i ++, p ++)
+    fprintf(fp, "hplip_conversion_stall_seconds_total{printer=\"%s\"} %.6f\n",
+	    hplip_metrics_escape(metrics->printers[i], buf, sizeof(buf)),
+	    p->stall_usec / 1000000.0);
+
+  num = __atomic_load_n(&metrics->num_conversions, __ATOMIC_ACQUIRE);
+  fputs("# HELP hplip_conversion_duration_seconds Time of the conversion paths, including sending to the driver and backend.\n"
+	"# TYPE hplip_conversion_duration_seconds histogram\n", fp);
+  for (i = 0; i < num; i ++)
+    hplip_metrics_print_histogram(fp, "hplip_conversion_duration_seconds",
+				  "conversion", metrics->conversions[i],
+				  &total.conversions[i]);
+
+  fprintf(fp,
+	  "# HELP hplip_render_cache_hits_total Jobs sent from the render cache.\n"
+	  "# TYPE hplip_render_cache_hits_total counter\n"
+	  "hplip_render_cache_hits_total %llu\n"
+	  "# HELP hplip_render_cache_misses_total Jobs not found in the render cache.\n"
+	  "# TYPE hplip_render_cache_misses_total counter\n"
+	  "hplip_render_cache_misses_total %llu\n"
+	  "# HELP hplip_render_cache_sent_bytes_total Bytes sent from the render cache to the driver.\n"
+	  "# TYPE hplip_render_cache_sent_bytes_total counter\n"
+	  "hplip_render_cache_sent_bytes_total %llu\n"
+	  "# HELP hplip_render_cache_copied_bytes_total Bytes of them copied in user space, as sendfile() could not be used.\n"
+	  "# TYPE hplip_render_cache_copied_bytes_total counter\n"
+	  "hplip_render_cache_copied_bytes_total %llu\n",
+	  total.counters[HPLIP_METRIC_CACHE_HITS],
+	  total.counters[HPLIP_METRIC_CACHE_MISSES],
+	  total.counters[HPLIP_METRIC_CACHE_BYTES],
+	  total.counters[HPLIP_METRIC_CACHE_COPIED]);
+  fprintf(fp,
+	  "# HELP hplip_scheduler_waits_total Conversions which waited for other jobs' conversions.\n"
+	  "# TYPE hplip_scheduler_waits_total counter\n"
+	  "hplip_scheduler_waits_total %llu\n"
+	  "# HELP hplip_scheduler_wait_seconds_total Time waited for other jobs' conversions.\n"
+	  "# TYPE hplip_scheduler_wait_seconds_total counter\n"
+	  "hplip_scheduler_wait_seconds_total %.6f\n",
+	  total.counters[HPLIP_METRIC_SCHED_WAITS],
+	  total.counters[HPLIP_METRIC_SCHED_WAIT_USEC] / 1000000.0);
+
+  fprintf(fp,
+	  "# HELP hplip_dnssd_discoveries_total Device listings from the DNS-SD browser.\n"
+	  "# TYPE hplip_dnssd_discoveries_total counter\n"
+	  "hplip_dnssd_discoveries_total %llu\n"
+	  "# HELP hplip_dnssd_discovery_seconds_total Time for the device listings from the DNS-SD browser.\n"
+	  "# TYPE hplip_dnssd_discovery_seconds_total counter\n"
+	  "hplip_dnssd_discovery_seconds_total %.6f\n",
+	  total.counters[HPLIP_METRIC_DNSSD_LISTS],
+	  total.counters[HPLIP_METRIC_DNSSD_LIST_USEC] / 1000000.0);
+  if ((browser = hplip_dnssd_browser(NULL)) != NULL)
+  {
+    pthread_mutex_lock(&browser->mutex);
+    num = browser->num_services;
+    pthread_mutex_unlock(&browser->mutex);
+    fprintf(fp,
+	    "# HELP hplip_dnssd_services Services in the table of the DNS-SD browser.\n"
+	    "# TYPE hplip_dnssd_services gauge\n"
+	    "hplip_dnssd_services %d\n", num);
+  }
+
+  // The HP backend runs as a separate program, its cache tells when
+  // it discovered the network printers the last time
+  if ((env = getenv("HP_CACHE")) == NULL)
+    snprintf(cachefile, sizeof(cachefile), "%s/hp-discovery.cache",
+	     hplip_state_dir());
+  else
+    snprintf(cachefile, sizeof(cachefile), "%s", env);
+  if (cachefile[0] && !stat(cachefile, &st))
+    fprintf(fp,
+	    "# HELP hplip_hp_discovery_age_seconds Age of the network printer list of the HP backend.\n"
+	    "# TYPE hplip_hp_discovery_age_seconds gauge\n"
+	    "hplip_hp_discovery_age_seconds %ld\n",
+	    (long)(time(NULL) - st.st_mtime));
+
+  fputs("# HELP hplip_plugin_phases_total Phases of downloading, installing, and removing the plugin.\n"
+	"# TYPE hplip_plugin_phases_total counter\n", fp);
+  for (i = 0; i < 4; i ++)
+    fprintf(fp,
+	    "hplip_plugin_phases_total{phase=\"%s\",status=\"ok\"} %llu\n"
+	    "hplip_plugin_phases_total{phase=\"%s\",status=\"failed\"} %llu\n",
+	    phases[i], total.counters[HPLIP_METRIC_PLUGIN_DOWNLOAD_FILE + 3 * i],
+	    phases[i],
+	    total.counters[HPLIP_METRIC_PLUGIN_DOWNLOAD_FILE + 3 * i + 1]);
+  fputs("# HELP hplip_plugin_phase_seconds_total Time for the phases of downloading, installing, and removing the plugin.\n"
+	"# TYPE hplip_plugin_phase_seconds_total counter\n", fp);
+  for (i = 0; i < 4; i ++)
+    fprintf(fp, "hplip_plugin_phase_seconds_total{phase=\"%s\"} %.6f\n",
+	    phases[i],
+	    total.counters[HPLIP_METRIC_PLUGIN_DOWNLOAD_FILE + 3 * i + 2] /
+	    1000000.0);
+
+  fclose(fp);
+
+  if (papplClientRespond(client, HTTP_STATUS_OK, NULL,
+			 "text/plain; version=0.0.4", 0, textlen))
+    httpWrite2(papplClientGetHTTP(client), text, textlen);
+  free(text);
+}
+
+
+//
+// 'hplip_system_setup()' - Callback function for the system setup:
+//                          Plugin support, SNMP polling, DNS-SD
+//                          discovery, metrics, and job events
+//
+
+void
+hplip_system_setup(void *data)
+{
+  pr_printer_app_global_data_t *global_data =
+    (pr_printer_app_global_data_t *)data;
+
+
+  hplip_plugin_support(data);
+  hplip_snmp_start(prGetSystem(global_data));
+  hplip_dnssd_start(prGetSystem(global_data));
+
+  // Job durations for the metrics, and the end of the job traces
+  papplSystemSetEventCallback(prGetSystem(global_data), hplip_job_event,
+			      NULL);
+
+  // Metrics for monitoring, in the text format of Prometheus
+  papplSystemAddResourceCallback(prGetSystem(global_data), "/metrics",
+				 "text/plain",
+				 (pappl_resource_cb_t)hplip_web_metrics,
+				 prGetSystem(global_data));
+}
+
+
+//
+// 'main()' - Main entry for the hplip-printer-app.
+//
+
+int
+main(int  argc,				// I - Number of command-line arguments
+     char *argv[])			// I - Command-line arguments
+{
+  cups_array_t *spooling_conversions,
+               *stream_formats,
+               *driver_selection_regex_list;
+
+  // Array of spooling conversions, most desirables first
+  //
   // Here we prefer not converting into another format
   // Keeping vector formats (like PS -> PDF) is usually more desirable
   // but as many printers have buggy PS interpreters we prefer converting
   // PDF to Raster and not to PS
+  //
+  // The conversions are wrapped to measure their cost on each printer,
+  // shown on the printer's "Conversions" web interface page
   spooling_conversions = cupsArrayNew(NULL, NULL);
-  cupsArrayAdd(spooling_conversions, (void *)&PR_CONVERT_PDF_TO_PS);
-  cupsArrayAdd(spooling_conversions, (void *)&PR_CONVERT_PDF_TO_RASTER);
-  cupsArrayAdd(spooling_conversions, (void *)&PR_CONVERT_PS_TO_PS);
-  cupsArrayAdd(spooling_conversions, (void *)&PR_CONVERT_PS_TO_RASTER);
+  cupsArrayAdd(spooling_conversions,
+	       (void *)hplip_conversion(&PR_CONVERT_PDF_TO_PS));
+  cupsArrayAdd(spooling_conversions,
+	       (void *)hplip_conversion(&PR_CONVERT_PDF_TO_RASTER));
+  cupsArrayAdd(spooling_conversions,
+	       (void *)hplip_conversion(&PR_CONVERT_PS_TO_PS));
+  cupsArrayAdd(spooling_conversions,
+	       (void *)hplip_conversion(&PR_CONVERT_PS_TO_RASTER));
+
+  // Scheduler for the conversions of all printers, shared with the
+  // filter processes
+  hplip_scheduler();
+
+  // Metrics, also counted by the filter processes
+  hplip_metrics();
+
+  // Temporary files of filters killed before this start
+  hplip_render_cache_evict(hplip_render_cache_size());
 
   // Array of stream formats, most desirables first
   //
@@ -1814,10 +7005,11 @@ main(int  argc,				// I - Number of command-line arguments
     prAutoAdd,               // Auto-add (driver assignment) callback
     NULL,                     // Printer identify callback (HPLIP backend
                               // does not support this)
-    prTestPage,              // Test page print callback
-    hplip_plugin_support,     // Update installed plugin during system setup
+    hplip_testpage,           // Test page print callback
+    hplip_system_setup,       // Update installed plugin during system setup
                               // and add web interface button and page for
-                              // plugin download
+                              // plugin download, start SNMP polling
+                              // and DNS-SD discovery, add metrics
     hplip_printer_extra_web_if, // Set up "Device Settings" printer web
                               // interface page and also add a link to
                               // the plugin web interface page to entries
@@ -1827,7 +7019,7 @@ main(int  argc,				// I - Number of command-line arguments
     stream_formats,           // Arrray for stream formats to be generated
                               // when printing in streaming mode
     "",                       // CUPS backends to be ignored
-    "hp,HP,snmp,dnssd,usb",   // CUPS backends to be used exclusively
+    "hp,HP,snmp,usb",         // CUPS backends to be used exclusively
                               // If empty all but the ignored backends are used
     TESTPAGE,                 // Test page (printable file), used by the
                               // standard test print callback prTestPage()